@@ -1,5 +1,6 @@
 #include "def.h"
 #include "type.h"
+#include "riscv.h"
 
 void test_physical_memory_allocator(){
 
@@ -30,4 +31,16 @@ void test_physical_memory_allocator(){
 
     kfree(page2);
     kfree(page3);
+
+    //contiguous alloc: 2^3 pages, naturally aligned
+    char *block = alloc_pages(3);
+    if(block != 0 && ((uint64)block & (8*PGSIZE - 1)) == 0){
+        block[8*PGSIZE - 1] = 0x5a;//touch the last page
+        printf("Physical memory allocator contiguous test passed.\n");
+    }
+    else{
+        printf("Physical memory allocator contiguous test failed.\n");
+        return;
+    }
+    free_pages(block, 3);
 }
\ No newline at end of file
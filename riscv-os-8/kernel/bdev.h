@@ -0,0 +1,30 @@
+#ifndef BDEV_H
+#define BDEV_H
+
+// 块设备驱动接口，bio.c 通过设备号找到驱动并调用这些操作
+struct bdev_ops {
+  // 异步提交读写请求；完成时驱动清除 b->disk，b->async 时调用 bdone(b)
+  void (*submit)(struct buf *b, int write);
+  // 等待 b 上已提交的请求完成
+  void (*wait)(struct buf *b);
+  // 开始/结束批量提交，plug 的返回值交给 unplug
+  int (*plug)(void);
+  void (*unplug)(int);
+  // 把设备的写缓存落盘，成功返回 0
+  int (*flush)(void);
+  // 通知设备 [blockno, blockno+n) 不再使用，不支持时返回 -1
+  int (*discard)(uint blockno, uint n);
+  // 把 [blockno, blockno+n) 写为全 0，不支持时返回 -1
+  int (*write_zeroes)(uint blockno, uint n);
+  // 设备容量（块数）
+  uint (*nblocks)(void);
+};
+
+struct bdev {
+  char *name;
+  struct bdev_ops *ops;
+};
+
+#define NBDEV 4 // 块设备号 0 .. NBDEV-1
+
+#endif // BDEV_H
@@ -6,126 +6,407 @@
 #include "def.h"
 #include "fs.h"
 #include "buf.h"
+#include "virtio.h"
+#include "bdev.h"
 
+#define BCHUNK_ORDER 4 // 缓冲块按 2^4 页为一组分配
 
-struct {
+// 哈希桶，每个桶一把锁，保护桶内链表以及桶内缓冲块的 refcnt/recent
+struct bucket {
     struct spinlock lock;
-    struct buf buf[NBUF];
-    struct buf head; // LRU cache list
+    struct buf *head;
+};
+
+struct {
+    struct spinlock lock; // 串行化换出，并保护 CLOCK 指针
+    struct buf *hand;     // CLOCK 换出指针
+    int nbuf;             // 启动时根据空闲内存确定
+    struct bucket *bucket;
+    int hbits;            // 桶数为 2^hbits
 } bcache;
 
+static struct bdev bdevs[NBDEV];// 按设备号索引的块设备驱动
+
+// 注册设备号 dev 的驱动
+void bdev_register(uint dev, char *name, struct bdev_ops *ops)
+{
+    if(dev >= NBDEV || bdevs[dev].ops)
+        panic("bdev_register");
+    bdevs[dev].name = name;
+    bdevs[dev].ops = ops;
+}
+
+static struct bdev_ops *bdev_ops(uint dev)
+{
+    if(dev >= NBDEV || bdevs[dev].ops == 0)
+        panic("bdev: no such device");
+    return bdevs[dev].ops;
+}
+
+// 按 (dev, blockno) 计算桶号（乘法哈希取高位）
+static inline int bhash(uint dev, uint blockno)
+{
+    return ((blockno + dev * 0x10001u) * 2654435761u) >> (32 - bcache.hbits);
+}
+
+// 分配至少 sz 字节的物理连续内存
+static void *bcache_alloc(uint64 sz)
+{
+    int k = 0;
+    while(((uint64)PGSIZE << k) < sz)
+        k++;
+    return alloc_pages(k);
+}
+
 // Initialize the buffer cache.
 void binit(void){
-    struct buf *b;
+    struct buf *b = 0, *last = 0;
+    int i, per, nbucket;
 
     initlock(&bcache.lock, "bcache");
 
-    // create linked list of buffers
-    bcache.head.prev = &bcache.head;
-    bcache.head.next = &bcache.head;
-    for(b = bcache.buf; b < bcache.buf + NBUF; b++){
-        b->next = bcache.head.next;
-        b->prev = &bcache.head;
+    // 缓冲块数量按空闲内存的 1/BCACHE_SHARE 决定
+    bcache.nbuf = pmm_freepages() * PGSIZE / BCACHE_SHARE / sizeof(struct buf);
+    if(bcache.nbuf < NBUF_MIN)
+        bcache.nbuf = NBUF_MIN;
+    if(bcache.nbuf > NBUF_MAX)
+        bcache.nbuf = NBUF_MAX;
+
+    // 桶数取不小于 nbuf/2 的 2 的幂
+    bcache.hbits = 4;
+    while((1 << bcache.hbits) < bcache.nbuf / 2)
+        bcache.hbits++;
+    nbucket = 1 << bcache.hbits;
+    bcache.bucket = bcache_alloc(nbucket * sizeof(struct bucket));
+    if(bcache.bucket == 0)
+        panic("binit: bucket");
+    for(i = 0; i < nbucket; i++){
+        initlock(&bcache.bucket[i].lock, "bcache.bucket");
+        bcache.bucket[i].head = 0;
+    }
+
+    // 缓冲块按组分配，所有缓冲块串成 CLOCK 环
+    per = (PGSIZE << BCHUNK_ORDER) / sizeof(struct buf);
+    for(i = 0; i < bcache.nbuf; i++){
+        if(i % per == 0 && (b = alloc_pages(BCHUNK_ORDER)) == 0)
+            panic("binit: buf");
         initsleeplock(&b->lock, "buffer");
-        bcache.head.next->prev = b;
-        bcache.head.next = b;
+        b->valid = 0;
+        b->disk = 0;
+        b->async = 0;
+        b->poll = VDISK_DEFAULT;
+        b->sleeping = 0;
+        b->refcnt = 0;
+        b->bucket = -1;
+        b->recent = 0;
+        b->hnext = 0;
+        if(last)
+            last->cnext = b;
+        else
+            bcache.hand = b;
+        last = b;
+        b++;
     }
+    last->cnext = bcache.hand;
+
+    printf("binit: %d buffers, %d buckets\n", bcache.nbuf, nbucket);
+}
+
+// 在桶中查找块，调用者需持有桶锁
+static struct buf* bucket_find(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  }
+  return 0;
+}
+
+// 从桶中摘除缓冲块，调用者需持有桶锁
+static void bucket_remove(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp; pp = &(*pp)->hnext){
+    if(*pp == b){
+      *pp = b->hnext;
+      b->hnext = 0;
+      b->bucket = -1;
+      return;
+    }
+  }
+  panic("bucket_remove");
+}
+
+// CLOCK 算法选出一个未被引用的缓冲块并把它从原来的桶中摘除
+// 调用者需持有 bcache.lock
+static struct buf* bvictim(void)
+{
+  struct buf *b;
+  struct bucket *ob;
+
+  for(int i = 0; i < 2 * bcache.nbuf; i++){
+    b = bcache.hand;
+    bcache.hand = b->cnext;
+
+    if(b->bucket < 0){
+      // 从未使用过的缓冲块，不在任何桶中
+      if(b->refcnt == 0)
+        return b;
+      continue;
+    }
+
+    ob = &bcache.bucket[b->bucket];
+    acquire(&ob->lock);
+    if(b->refcnt == 0){
+      if(b->recent == 0){
+        bucket_remove(ob, b);
+        release(&ob->lock);
+        return b;
+      }
+      b->recent = 0; // 给一次“第二次机会”
+    }
+    release(&ob->lock);
+  }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // Returns locked buffer.
-static struct buf* bget(uint dev, uint blockno)
+// prefetch 为 1 时不等待：块已在缓存中或没有可换出的缓冲块时返回 0
+static struct buf* bget_common(uint dev, uint blockno, int prefetch)
 {
   struct buf *b;
+  int h = bhash(dev, blockno);
+  struct bucket *bk = &bcache.bucket[h];
 
-  acquire(&bcache.lock);
+  // Is the block already cached? 只需要该桶的锁
+  acquire(&bk->lock);
+  if((b = bucket_find(bk, dev, blockno)) != 0){
+    if(prefetch){
+      release(&bk->lock);
+      return 0;
+    }
+    b->refcnt++;
+    b->recent = 1;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bk->lock);
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
+  // Not cached. 换出过程串行化；插入新块也只发生在持有 bcache.lock 时，
+  // 所以重新检查一次后，其他进程不可能再把同一个块放进桶里
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = bucket_find(bk, dev, blockno)) != 0){
+    if(prefetch){
+      release(&bk->lock);
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      return 0;
     }
+    b->refcnt++;
+    b->recent = 1;
+    release(&bk->lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
-  // Not cached.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+  if((b = bvictim()) == 0){
+    if(prefetch){
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      return 0;
     }
+    panic("bget: no buffers");
   }
-  
-  panic("bget: no buffers");
+
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->recent = 1;
+
+  // 换出的缓冲块 refcnt 为 0，睡眠锁必然空闲，不会睡眠；
+  // 在放入桶之前加锁，保证发起读请求的一定是分配它的一方
+  acquiresleep(&b->lock);
+
+  acquire(&bk->lock);
+  b->bucket = h;
+  b->hnext = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.lock);
+
+  return b;
+}
+
+static struct buf* bget(uint dev, uint blockno)
+{
+  return bget_common(dev, blockno, 0);
+}
+
+// Return a locked buf for the indicated block, starting a read
+// if it is not cached.  Call bwait() before using b->data.
+struct buf* bread_async(uint dev, uint blockno){
+    struct buf *b;
+
+    b = bget(dev, blockno);
+    if(!b->valid && !b->disk)
+        bdev_ops(dev)->submit(b, 0);
+    return b;
+}
+
+// Wait for the I/O started on a locked buf to finish.
+void bwait(struct buf *b){
+    if(b->disk)
+        bdev_ops(b->dev)->wait(b);
+    b->valid = 1;
+}
+
+// Return a locked buf for the indicated block without reading it,
+// for callers that overwrite the whole block.
+struct buf* bgetblk(uint dev, uint blockno){
+    return bget(dev, blockno);
 }
 
 // Return a locked buf with the contents of the indicated block.
 struct buf* bread(uint dev, uint blockno){
     struct buf *b;
 
-    // printf("bread calling bget(dev=%d, blockno=%d)\n", dev, blockno);
-    b = bget(dev, blockno);
-    if(!b->valid){
-        // printf("bread calling virtio_disk_rw(b=%x)\n", b);
-        virtio_disk_rw(b, 0);
-        b->valid = 1;
-    }
-    // printf("bread returning b=%x\n", b);
+    b = bread_async(dev, blockno);
+    bwait(b);
+    return b;
+}
+
+// 与 bread 相同，但以混合轮询方式等待完成，用于延迟敏感的元数据读取
+struct buf* bread_poll(uint dev, uint blockno){
+    struct buf *b;
+
+    b = bread_async(dev, blockno);
+    b->poll = VDISK_HYBRID;
+    bwait(b);
+    b->poll = VDISK_DEFAULT;
     return b;
 }
 
+// Start writing b's contents to disk.  Must be locked; call
+// bwait() before releasing or modifying it.
+void bwrite_async(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  bdev_ops(b->dev)->submit(b, 1);
+}
+
 // Write b's contents to disk.  Must be locked.
 void bwrite(struct buf *b)
 {
-  if(!holdingsleep(&b->lock))
-    panic("bwrite");
-  virtio_disk_rw(b, 1);
+  bwrite_async(b);
+  bwait(b);
+}
+
+// 预读：块不在缓存中时分配缓冲块并发起异步读，不等待完成。
+// 缓冲块由磁盘中断通过 bdone() 解锁并释放
+void bprefetch(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bget_common(dev, blockno, 1)) == 0)
+    return;
+  b->async = 1;
+  bdev_ops(dev)->submit(b, 0);
+}
+
+// 在 bplug() 与 bunplug() 之间对设备 dev 发起的异步请求先排队，bunplug() 时
+// 把块号连续的请求合并提交。两者之间不能睡眠
+int bplug(uint dev)
+{
+  return bdev_ops(dev)->plug();
+}
+
+void bunplug(uint dev, int q)
+{
+  bdev_ops(dev)->unplug(q);
+}
+
+// 把设备的写缓存落盘
+int bflush(uint dev)
+{
+  return bdev_ops(dev)->flush();
+}
+
+// 通知设备这些块不再使用
+int bdiscard(uint dev, uint blockno, uint n)
+{
+  return bdev_ops(dev)->discard(blockno, n);
+}
+
+// 由设备把这些块写为全 0，不支持时返回 -1，调用者自己写 0
+int bwrite_zeroes(uint dev, uint blockno, uint n)
+{
+  return bdev_ops(dev)->write_zeroes(blockno, n);
+}
+
+// 设备容量（块数）
+uint bdev_size(uint dev)
+{
+  return bdev_ops(dev)->nblocks();
+}
+
+// 异步请求完成时由磁盘中断调用
+void bdone(struct buf *b)
+{
+  struct bucket *bk = &bcache.bucket[b->bucket];
+
+  b->async = 0;
+  b->valid = 1;
+  releasesleep_intr(&b->lock);
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  release(&bk->lock);
 }
 
 // Release a locked buffer.
 void brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   // printf("brelse called b=%x\n", b);
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
-  acquire(&bcache.lock);
+
+  // refcnt > 0 时缓冲块不会被换出，b->bucket 不会变化
+  bk = &bcache.bucket[b->bucket];
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
   // printf("brelse completed b=%x\n", b);
 }
 
 // Pin a buffer in the cache.
 void bpin(struct buf *b){
-    acquire(&bcache.lock);
+    struct bucket *bk = &bcache.bucket[b->bucket];
+
+    acquire(&bk->lock);
     b->refcnt++;
-    release(&bcache.lock);
+    release(&bk->lock);
 }
 
 // Unpin a buffer from the cache.
 void bunpin(struct buf *b){
-    acquire(&bcache.lock);
+    struct bucket *bk = &bcache.bucket[b->bucket];
+
+    acquire(&bk->lock);
     if(b->refcnt <= 0)
         panic("bunpin");
     b->refcnt--;
-    release(&bcache.lock);
-}
\ No newline at end of file
+    release(&bk->lock);
+}
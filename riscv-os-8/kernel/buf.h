@@ -3,11 +3,20 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int write;   // direction of the request in flight
+  int async;   // no waiter; the disk interrupt releases buf (bdone)
+  int sleeping; // a waiter sleeps in virtio_disk_wait()
+  int qid;     // virtqueue the request was submitted on
+  int poll;    // wait mode for this request (VDISK_*), VDISK_DEFAULT = driver default
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  int bucket;       // hash bucket index, -1 if not hashed
+  int recent;       // CLOCK reference bit
+  struct buf *hnext; // hash bucket chain
+  struct buf *cnext; // CLOCK ring of all buffers
+  struct buf *qnext; // disk request queue
+  uint64 qtime;      // when the request was queued (iosched deadline)
   uchar data[BSIZE]; __attribute__((aligned(8)));
 };
\ No newline at end of file
@@ -10,6 +10,9 @@ struct inode;
 struct file;
 struct stat;
 struct sleeplock;
+struct bdev_ops;
+struct ioq;
+struct iosched_ops;
 
 //uart.c
 
@@ -36,8 +39,14 @@ void test_edge_cases();
 //kalloc.c
 void pmm_init(void);
 void kref_inc(void *);
+int  kref_get(void *);
 void kfree(char *pa);
 void* alloc(void);
+void* alloc_zeroed(void);
+void  kzerod(void);
+uint64 pmm_freepages(void);
+void* alloc_pages(int order);
+void  free_pages(void *pa, int order);
 
 //TestAlloc.c
 void test_physical_memory_allocator();
@@ -53,6 +62,8 @@ void* memset(void *dst, int c, uint n);
 int   memcmp(const void *v1, const void *v2, uint n);
 void* memmove(void *dst, const void *src, uint n);
 void* memcpy(void *dst, const void *src, uint n);
+void  zero_page(void *dst);
+void  copy_page(void *dst, const void *src);
 int   strncmp(const char *p, const char *q, uint n);
 char* strncpy(char *s, const char *t, int n);
 char* safestrcpy(char *s, const char *t, int n);
@@ -145,19 +156,53 @@ void syscall();
 // virtio_disk.c
 void virtio_disk_init(void);
 void virtio_disk_rw(struct buf *, int);
+void virtio_disk_submit(struct buf *, int);
+void virtio_disk_wait(struct buf *);
+int virtio_disk_plug(void);
+void virtio_disk_pollmode(int);
+void virtio_disk_unplug(int);
 void virtio_disk_intr(void);
 
+// iosched.c
+void ioq_init(struct ioq*, char*, struct iosched_ops*);
+void ioq_add(struct ioq*, struct buf*);
+int ioq_empty(struct ioq*);
+struct buf* ioq_peek(struct ioq*, int, int*);
+struct buf* ioq_take(struct ioq*);
+void iosched_dump(void);
+
+// ramdisk.c
+void ramdisk_init(void);
+
 // log.c
 void initlog(int, struct superblock*);
 void log_write(struct buf*);
 void begin_op(void);
 void end_op(void);
+void logd(void);
+void log_sync(void);
+void log_free(uint);
+int log_reuse(uint);
 
 // bio.c
 void binit(void);
 struct buf* bread(uint, uint);
+struct buf* bread_async(uint, uint);
+struct buf* bgetblk(uint, uint);
+struct buf* bread_poll(uint, uint);
+void bwait(struct buf*);
 void brelse(struct buf*);
 void bwrite(struct buf*);
+void bwrite_async(struct buf*);
+void bprefetch(uint, uint);
+int bplug(uint);
+void bunplug(uint, int);
+int bflush(uint);
+int bdiscard(uint, uint, uint);
+int bwrite_zeroes(uint, uint, uint);
+uint bdev_size(uint);
+void bdev_register(uint, char*, struct bdev_ops*);
+void bdone(struct buf*);
 void bpin(struct buf*);
 void bunpin(struct buf*);
 
@@ -174,6 +219,7 @@ int filewrite(struct file*, uint64, int n);
 void fsinit(int);
 int dirlink(struct inode*, char*, uint);
 struct inode* dirlookup(struct inode*, char*, uint*);
+void dcache_remove(struct inode*, char*);
 struct inode* ialloc(uint, short);
 struct inode* idup(struct inode*);
 void iinit();
@@ -206,5 +252,6 @@ void plic_complete(int);
 // sleeplock.c
 void acquiresleep(struct sleeplock*);
 void releasesleep(struct sleeplock*);
+void releasesleep_intr(struct sleeplock*);
 int holdingsleep(struct sleeplock*);
 void initsleeplock(struct sleeplock*, char*);
\ No newline at end of file
@@ -27,7 +27,17 @@ struct inode{
     short minor;       // 次设备号（仅用于设备文件）
     short nlink;       // 硬链接数量
     uint size;         // 文件大小（以字节为单位）
-    uint addrs[NDIRECT+1]; // 数据块地址
+    ushort ext_n;      // 区间树根的项数
+    uchar ext_depth;   // 区间树深度
+    uchar flags;       // I_DXDIR 等
+    struct extent ext[NEXTENT]; // 区间树的根
+    struct extent ecache; // 上一次查到的数据区间，len 为 0 表示无效
+    struct inode *hnext;  // 哈希链
+    struct inode *lprev, *lnext; // ref 为 0 时在 LRU 链表上；空闲时 lnext 串成空闲链表
+
+    uint ra_next;      // 预读：期望的下一次顺序读的块号
+    uint ra_end;       // 预读：已发起预读的块号上界（不含）
+    uint ra_win;       // 预读：当前窗口大小（块），0 表示非顺序读
 };
 
 struct devsw {
@@ -14,6 +14,21 @@
 
 struct superblock sb;
 
+// 块分配。有目标块（文件上一块的下一块）时优先分配它，让文件在磁盘上连续；
+// 目标块被占用时从它向后找。没有目标块时从游标处开始找，游标随分配前进，
+// 不必每次从头扫描。正在追加的文件在最后一块之后预留一个窗口，
+// 其他文件的分配跳过这些块，并发追加的文件因此各自保持连续。
+// 窗口只在内存中，位图中这些块仍是空闲的，崩溃后自然失效
+static struct {
+  struct spinlock lock;
+  struct {
+    struct inode *ip;  // 0 表示空闲项
+    uint start, end;   // 预留的块 [start, end)
+  } w[NRSV];
+  int next;            // 表满时轮流替换
+  uint cursor;         // 没有目标块时从这里开始找；与 sb 一样只有一个文件系统
+} rsvtab;
+
 // 获取设备 dev 上的文件系统超级块信息
 static void readsb(int dev, struct superblock *sb)
 {
@@ -34,46 +49,180 @@ void fsinit(int dev) {
          dev, sb.magic, sb.size, sb.nblocks, sb.ninodes);
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
+  initlock(&rsvtab.lock, "rsvtab");
   initlog(dev, &sb);
   ireclaim(dev);
 }
 
-// 将设备 dev 上的块 bno 清零
+// 将设备 dev 上新分配的块 bno 清零。块会被整块覆盖，不必先读盘。
+// 设备支持 write zeroes 时由设备清零，不经过日志：块在磁盘上是空闲的，
+// 崩溃后清零也无害。但本批事务中刚释放的块在提交前磁盘上仍属于原来的
+// 文件，不能直接改写，只能像以前一样把全 0 写进日志。log_reuse() 同时把块从
+// 待 discard 的区间中去掉
 static void bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bgetblk(dev, bno);
   memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  bp->valid = 1;
+  if(log_reuse(bno) || bwrite_zeroes(dev, bno, 1) < 0)
+    log_write(bp);
   brelse(bp);
 }
 
-// 分配设备 dev 上的一个数据块，返回块号
-static uint balloc(uint dev)
+// 块 b 是否在 ip 以外的文件的预留窗口中
+static int rsv_other(struct inode *ip, uint b)
+{
+  int i, r = 0;
+
+  acquire(&rsvtab.lock);
+  for(i = 0; i < NRSV; i++){
+    if(rsvtab.w[i].ip && rsvtab.w[i].ip != ip &&
+       b - rsvtab.w[i].start < rsvtab.w[i].end - rsvtab.w[i].start){
+      r = 1;
+      break;
+    }
+  }
+  release(&rsvtab.lock);
+  return r;
+}
+
+// ip 分配到了块 b。b 不在它的窗口中（窗口用完或被占用）时在 b 之后开一个新窗口，
+// 大小是原来的两倍，从 RSV_MIN 到 RSV_MAX，持续追加的文件得到越来越长的连续区间
+static void rsv_update(struct inode *ip, uint b)
+{
+  int i, k = -1;
+  uint size = RSV_MIN;
+
+  acquire(&rsvtab.lock);
+  for(i = 0; i < NRSV; i++){
+    if(rsvtab.w[i].ip == ip){
+      k = i;
+      break;
+    }
+    if(k < 0 && rsvtab.w[i].ip == 0)
+      k = i;
+  }
+  if(k >= 0 && rsvtab.w[k].ip == ip){
+    if(b - rsvtab.w[k].start < rsvtab.w[k].end - rsvtab.w[k].start){
+      release(&rsvtab.lock);
+      return;
+    }
+    size = min(2 * (rsvtab.w[k].end - rsvtab.w[k].start), RSV_MAX);
+  }
+  if(k < 0){
+    k = rsvtab.next;
+    rsvtab.next = (rsvtab.next + 1) % NRSV;
+  }
+  rsvtab.w[k].ip = ip;
+  rsvtab.w[k].start = b + 1;
+  rsvtab.w[k].end = b + 1 + size;
+  release(&rsvtab.lock);
+}
+
+// 文件不再被引用或被截断时取消它的预留窗口
+static void rsv_drop(struct inode *ip)
+{
+  int i;
+
+  acquire(&rsvtab.lock);
+  for(i = 0; i < NRSV; i++)
+    if(rsvtab.w[i].ip == ip)
+      rsvtab.w[i].ip = 0;
+  release(&rsvtab.lock);
+}
+
+// 块 b 空闲时把它标记为已用并返回 1
+static int btake(uint dev, uint b)
 {
-  int b, bi, m;
   struct buf *bp;
+  int bi, m;
+
+  bp = bread(dev, BBLOCK(b, sb));
+  bi = b % BPB;
+  m = 1 << (bi % 8);
+  if(bp->data[bi/8] & m){
+    brelse(bp);
+    return 0;
+  }
+  bp->data[bi/8] |= m;
+  log_write(bp);
+  brelse(bp);
+  return 1;
+}
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+// 从块 start 开始找第一个空闲的块（skip 为 1 时还要不在其他文件的预留窗口中），
+// 标记为已用，到末尾后从头回绕。位图每次检查 64 位，跳过全满的字；
+// 位图按字节小端排列，与 RISC-V 上 64 位字的位序一致。没有空闲块时返回 0
+static uint bscan(uint dev, struct inode *ip, uint start, int skip)
+{
+  uint b, base, end, k;
+  uint64 *w, x;
+  struct buf *bp;
+  int pass;
+
+  for(pass = 0; pass < 2; pass++){
+    b = pass == 0 ? start & ~63u : 0;
+    end = pass == 0 ? sb.size : start;
+    while(b < end){
+      base = b - b % BPB;
+      bp = bread(dev, BBLOCK(b, sb));
+      w = (uint64*)bp->data;
+      for(; b < base + BPB && b < end; b += 64){
+        x = ~w[(b - base) / 64];
+        if(b < start && pass == 0)
+          x &= ~0UL << (start - b);
+        for(; x; x &= x - 1){
+          for(k = 0; !((x >> k) & 1); k++)
+            ;
+          if(b + k >= sb.size)
+            break;
+          if(skip && rsv_other(ip, b + k))
+            continue;
+          w[(b - base) / 64] |= 1UL << k;
+          log_write(bp);
+          brelse(bp);
+          return b + k;
+        }
       }
+      brelse(bp);
     }
-    brelse(bp);
   }
-  printf("balloc: out of blocks\n");
   return 0;
 }
 
+// 分配设备 dev 上的一个数据块并清零，返回块号。
+// goal 为目标块，0 表示没有；ip 为追加数据的文件，为它维护预留窗口，
+// 分配区间树节点等不需要连续的块时 ip 为 0
+static uint balloc(uint dev, struct inode *ip, uint goal)
+{
+  uint b;
+
+  if(goal >= sb.size)
+    goal = 0;
+  if(goal && !rsv_other(ip, goal) && btake(dev, goal)){
+    b = goal;
+  } else if(goal){
+    b = bscan(dev, ip, goal, 1);
+  } else {
+    b = bscan(dev, ip, rsvtab.cursor, 1);
+    rsvtab.cursor = b + 1 < sb.size ? b + 1 : 0;
+  }
+  // 只剩其他文件预留的块时也可以用
+  if(b == 0)
+    b = bscan(dev, ip, 0, 0);
+  if(b == 0){
+    printf("balloc: out of blocks\n");
+    return 0;
+  }
+  // 文件已经在追加（有目标块）时才预留，只有一块的小文件不留空隙
+  if(ip && goal)
+    rsv_update(ip, b);
+  bzero(dev, b);
+  return b;
+}
+
 // 释放设备 dev 上的一个数据块 b
 static void bfree(int dev, uint b)
 {
@@ -88,26 +237,139 @@ static void bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  log_free(b); // 提交之后 discard
 }
 
+// i节点缓存：按 (dev, inum) 哈希查找。ref 降为 0 的有效 i节点不立即丢弃，
+// 按使用顺序挂在 LRU 链表上，再次打开时不必重新读 i节点块。需要新的 i节点时
+// 先用空闲链表中的，没有就按页分配，总数达到 NINODE_MAX 后换出最久未用的
+#define NIHASH 64
+
 struct {
     struct spinlock lock;
-    struct inode inode[NINODE];
-
+    struct inode *hash[NIHASH];
+    struct inode *lru_head;  // 最久未用
+    struct inode *lru_tail;  // 最近用过
+    struct inode *free;      // 从未用过或已失效的 i节点，用 lnext 串起来
+    int n;                   // 已分配的 i节点数
 } itable;
 
+static inline int ihash(uint dev, uint inum)
+{
+  return (inum + dev * 0x10001u) % NIHASH;
+}
+
+// 目录项缓存：(设备, 父目录 i节点号, 名字) -> (i节点号, 目录项偏移)。
+// inum 为 0 的是否定项，记录“该名字不存在”，重复查找不存在的名字也不必读目录块。
+// 缓存只由 dirlookup() 填充，dirlink() 和删除目录项时（dcache_remove）更新，
+// 目录 i节点被释放时清掉与它有关的所有项。项满后用时钟算法换出：
+// 命中时置 referenced，指针扫过时清掉它，跳过最近命中过的项
+struct dentry {
+  uint dev;
+  uint dinum;              // 父目录，0 表示空项
+  char name[DIRSIZ];
+  uint inum;               // 0 表示否定项
+  uint off;                // 目录项在父目录中的偏移
+  int referenced;          // 上次指针扫过之后命中过
+  struct dentry *hnext;
+};
+
+#define NDHASH 64
+
+struct {
+  struct spinlock lock;
+  struct dentry ent[NDCACHE];
+  struct dentry *hash[NDHASH];
+  int hand;                // 下一个被换出的项
+} dcache;
+
 // 初始化 i节点表
 void iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  initlock(&dcache.lock, "dcache");
+}
+
+// 以下函数调用者需持有 itable.lock
+
+static void lru_remove(struct inode *ip)
+{
+  if(ip->lprev)
+    ip->lprev->lnext = ip->lnext;
+  else
+    itable.lru_head = ip->lnext;
+  if(ip->lnext)
+    ip->lnext->lprev = ip->lprev;
+  else
+    itable.lru_tail = ip->lprev;
+  ip->lprev = ip->lnext = 0;
+}
+
+static void lru_append(struct inode *ip)
+{
+  ip->lnext = 0;
+  ip->lprev = itable.lru_tail;
+  if(itable.lru_tail)
+    itable.lru_tail->lnext = ip;
+  else
+    itable.lru_head = ip;
+  itable.lru_tail = ip;
+}
+
+static void ihash_remove(struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &itable.hash[ihash(ip->dev, ip->inum)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == ip){
+      *pp = ip->hnext;
+      ip->hnext = 0;
+      return;
+    }
+  }
+  panic("ihash_remove");
+}
+
+// 分配一页新的 i节点放入空闲链表
+static int igrow(void)
+{
+  struct inode *ip = alloc();
+  int i, n = PGSIZE / sizeof(struct inode);
+
+  if(ip == 0)
+    return -1;
+  memset(ip, 0, PGSIZE);
+  for(i = 0; i < n && itable.n < NINODE_MAX; i++, ip++){
+    initsleeplock(&ip->lock, "inode");
+    ip->lnext = itable.free;
+    itable.free = ip;
+    itable.n++;
+  }
+  return 0;
+}
+
+// 取一个可以重新使用的 i节点，都在使用中时返回 0
+static struct inode* ivictim(void)
+{
+  struct inode *ip;
+
+  if(itable.free == 0 && itable.n < NINODE_MAX)
+    igrow();
+  if((ip = itable.free) != 0){
+    itable.free = ip->lnext;
+    ip->lnext = 0;
+    return ip;
+  }
+  if((ip = itable.lru_head) != 0){
+    lru_remove(ip);
+    ihash_remove(ip);
+    return ip;
   }
+  return 0;
 }
 
 static struct inode* iget(uint dev, uint inum);
+static void dcache_forget(struct inode*);
 
 // 分配一个新的 i节点，类型为 type，返回指向该 i节点的指针
 struct inode* ialloc(uint dev, short type)
@@ -115,16 +377,19 @@ struct inode* ialloc(uint dev, short type)
   int inum;
   struct buf *bp;
   struct dinode *dip;
+  struct inode *ip;
 
   for(inum = 1; inum < sb.ninodes; inum++){
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
+      // 先取得内存中的 i节点，再在磁盘上标记为已分配
+      ip = iget(dev, inum);
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
-      return iget(dev, inum);
+      return ip;
     }
     brelse(bp);
   }
@@ -145,7 +410,10 @@ void iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  dip->ext_n = ip->ext_n;
+  dip->ext_depth = ip->ext_depth;
+  dip->flags = ip->flags;
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
   log_write(bp);
   brelse(bp);
 }
@@ -153,30 +421,32 @@ void iupdate(struct inode *ip)
 // 从设备 dev 上获取 i节点 inum，返回指向该 i节点的指针
 static struct inode* iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  int h = ihash(dev, inum);
 
   acquire(&itable.lock);
 
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = itable.hash[h]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      // 缓存中保留的 i节点仍然有效，ilock() 不必再读盘
+      if(ip->ref++ == 0)
+        lru_remove(ip);
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  // 调用者无法区分“没有空位”和“不存在”，和以前一样直接 panic
+  if((ip = ivictim()) == 0)
     panic("iget: no inodes");
-
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ra_next = ip->ra_end = ip->ra_win = 0;
+  ip->ecache.len = 0;
+  ip->hnext = itable.hash[h];
+  itable.hash[h] = ip;
   release(&itable.lock);
 
   return ip;
@@ -203,14 +473,18 @@ void ilock(struct inode *ip)
   acquiresleep(&ip->lock);
 
   if(ip->valid == 0){
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+    bp = bread_poll(ip->dev, IBLOCK(ip->inum, sb));
     dip = (struct dinode*)bp->data + ip->inum%IPB;
     ip->type = dip->type;
     ip->major = dip->major;
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    ip->ext_n = dip->ext_n;
+    ip->ext_depth = dip->ext_depth;
+    ip->flags = dip->flags;
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    ip->ecache.len = 0;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -242,13 +516,25 @@ void iput(struct inode *ip)
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    dcache_forget(ip);
 
     releasesleep(&ip->lock);
 
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(ip->ref == 1)
+    rsv_drop(ip);
+  if(--ip->ref == 0){
+    // 有效的 i节点留在缓存中，失效的（已释放或从未读入）放回空闲链表
+    if(ip->valid){
+      lru_append(ip);
+    } else {
+      ihash_remove(ip);
+      ip->lnext = itable.free;
+      itable.free = ip;
+    }
+  }
   release(&itable.lock);
 }
 
@@ -282,75 +568,228 @@ void ireclaim(int dev)
   }
 }
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-static uint bmap(struct inode *ip, uint bn)
-{
-  uint addr, *a;
+// 文件块的映射是一棵区间树（类似 ext4）：根有 NEXTENT 项，内嵌在 i节点中，
+// 其余节点各占一块。物理上连续的块合并为一个区间，连续存放的文件只需一项。
+// 文件只在末尾增长、只整体截断，所以新区间总是追加在最右边
+
+// 区间树中的一个节点：根在 i节点中（bp 为 0），其余节点在块中
+struct enode {
+  struct extent *e;
+  ushort *n;
+  int max;
   struct buf *bp;
+};
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[bn] = addr;
+// 在 n 个按 lblk 递增的项中找最后一个 lblk <= bn 的项，没有时返回 -1
+static int ext_search(struct extent *e, int n, uint bn)
+{
+  int lo = 0, hi = n - 1, mid, r = -1;
+
+  while(lo <= hi){
+    mid = (lo + hi) / 2;
+    if(e[mid].lblk <= bn){
+      r = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
     }
-    return addr;
   }
-  bn -= NDIRECT;
+  return r;
+}
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
-        log_write(bp);
+// 查找逻辑块 bn 所在的数据区间，找到时复制到 *out 并返回 1。
+// 先看上一次命中的区间，顺序访问时几乎都在这里命中；否则从根向下逐层二分查找
+static int ext_find(struct inode *ip, uint bn, struct extent *out)
+{
+  struct extent *e = ip->ext;
+  int n = ip->ext_n, depth = ip->ext_depth, i, found = 0;
+  struct buf *bp = 0, *nbp;
+  struct extent_block *eb;
+
+  if(ip->ecache.len && bn - ip->ecache.lblk < ip->ecache.len){
+    *out = ip->ecache;
+    return 1;
+  }
+
+  while((i = ext_search(e, n, bn)) >= 0){
+    if(depth == 0){
+      if(bn - e[i].lblk < e[i].len){
+        *out = ip->ecache = e[i];
+        found = 1;
       }
+      break;
     }
-    brelse(bp);
-    return addr;
+    nbp = bread(ip->dev, e[i].pblk);
+    if(bp)
+      brelse(bp);
+    bp = nbp;
+    eb = (struct extent_block*)bp->data;
+    if(eb->depth != depth - 1)
+      panic("ext_find: bad depth");
+    e = eb->e;
+    n = eb->n;
+    depth = eb->depth;
   }
+  if(bp)
+    brelse(bp);
+  return found;
+}
 
-  panic("bmap: out of range");
+// 在新分配的块 blk 中建立深度为 depth、只有一项 x 的节点
+static void ext_newnode(struct inode *ip, uint blk, int depth, struct extent x)
+{
+  struct buf *bp = bread(ip->dev, blk);
+  struct extent_block *eb = (struct extent_block*)bp->data;
+
+  eb->n = 1;
+  eb->depth = depth;
+  eb->e[0] = x;
+  log_write(bp);
+  brelse(bp);
 }
 
-// Truncate inode (remove contents).
-void itrunc(struct inode *ip)
+// 追加映射 lblk -> pblk，lblk 紧接在已映射的最后一块之后。成功返回 0。
+// 与最后一个区间物理上连续时直接延长它；否则在最右的叶子中加一项，
+// 叶子满了就沿最右路径向上找到有空位的一层，从那里长出一条新路径；
+// 根也满了时把根的项搬到一个新块中，树长高一层。
+// 根的修改由调用者 iupdate() 写回
+static int ext_append(struct inode *ip, uint lblk, uint pblk)
 {
-  int i, j;
+  struct enode path[EXT_MAXDEPTH + 1];// path[d] 是最右路径上深度为 d 的节点
+  int depth = ip->ext_depth, d, k, r = -1;
+  uint nb[EXT_MAXDEPTH], blk;
+  struct extent *last, x;
+  struct extent_block *eb;
   struct buf *bp;
-  uint *a;
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
+  path[depth] = (struct enode){ ip->ext, &ip->ext_n, NEXTENT, 0 };
+  for(d = depth; d > 0; d--){
+    if(*path[d].n == 0)
+      panic("ext_append: empty node");
+    bp = bread(ip->dev, path[d].e[*path[d].n - 1].pblk);
+    eb = (struct extent_block*)bp->data;
+    path[d-1] = (struct enode){ eb->e, &eb->n, EXT_PER_BLOCK, bp };
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  if(*path[0].n > 0){
+    last = &path[0].e[*path[0].n - 1];
+    if(last->lblk + last->len != lblk)
+      panic("ext_append: not at end");
+    if(last->pblk + last->len == pblk){
+      last->len++;
+      if(path[0].bp)
+        log_write(path[0].bp);
+      r = 0;
+      goto out;
     }
+  } else if(lblk != 0){
+    panic("ext_append: not at end");
+  }
+
+  // 最深的一层有空位的节点
+  for(k = 0; k <= depth && *path[k].n == path[k].max; k++)
+    ;
+  if(k > depth){
+    if(depth == EXT_MAXDEPTH || (blk = balloc(ip->dev, 0, 0)) == 0)
+      goto out;
+    bp = bread(ip->dev, blk);
+    eb = (struct extent_block*)bp->data;
+    eb->n = ip->ext_n;
+    eb->depth = depth;
+    memmove(eb->e, ip->ext, sizeof(ip->ext));
+    log_write(bp);
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+    ip->ext[0] = (struct extent){ ip->ext[0].lblk, blk, 0 };
+    ip->ext_n = 1;
+    ip->ext_depth = depth + 1;
+    for(d = 0; d < depth; d++)
+      brelse(path[d].bp);
+    return ext_append(ip, lblk, pblk);
+  }
+
+  // 第 k-1 .. 0 层各需要一个新块
+  for(d = 0; d < k; d++){
+    if((nb[d] = balloc(ip->dev, 0, 0)) == 0){
+      while(--d >= 0)
+        bfree(ip->dev, nb[d]);
+      goto out;
+    }
+  }
+  x = (struct extent){ lblk, pblk, 1 };
+  for(d = 0; d < k; d++){
+    ext_newnode(ip, nb[d], d, x);
+    x = (struct extent){ lblk, nb[d], 0 };
+  }
+  path[k].e[(*path[k].n)++] = x;
+  if(path[k].bp)
+    log_write(path[k].bp);
+  r = 0;
+
+out:
+  for(d = 0; d < depth; d++)
+    brelse(path[d].bp);
+  return r;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one.
+static uint bmap(struct inode *ip, uint bn)
+{
+  struct extent e;
+  uint addr, goal = 0;
+
+  if(ext_find(ip, bn, &e))
+    return e.pblk + (bn - e.lblk);
+
+  if(bn >= MAXFILE)
+    panic("bmap: out of range");
+  // 紧接在上一块之后分配，ext_append() 就只需要延长最后一个区间
+  if(bn > 0 && ext_find(ip, bn - 1, &e))
+    goal = e.pblk + (bn - e.lblk);
+  if((addr = balloc(ip->dev, ip, goal)) == 0)
+    return 0;
+  if(ext_append(ip, bn, addr) < 0){
+    bfree(ip->dev, addr);
+    return 0;
+  }
+  return addr;
+}
+
+// 释放 n 项、深度为 depth 的节点下的所有块
+static void ext_free(struct inode *ip, struct extent *e, int n, int depth)
+{
+  struct buf *bp;
+  struct extent_block *eb;
+  int i;
+  uint j;
+
+  for(i = 0; i < n; i++){
+    if(depth == 0){
+      for(j = 0; j < e[i].len; j++)
+        bfree(ip->dev, e[i].pblk + j);
+    } else {
+      bp = bread(ip->dev, e[i].pblk);
+      eb = (struct extent_block*)bp->data;
+      ext_free(ip, eb->e, eb->n, eb->depth);
+      brelse(bp);
+      bfree(ip->dev, e[i].pblk);
+    }
   }
+}
+
+// Truncate inode (remove contents).
+void itrunc(struct inode *ip)
+{
+  ext_free(ip, ip->ext, ip->ext_n, ip->ext_depth);
+  memset(ip->ext, 0, sizeof(ip->ext));
+  ip->ext_n = 0;
+  ip->ext_depth = 0;
+  ip->flags &= ~I_DXDIR;
+  ip->ecache.len = 0;
+  rsv_drop(ip);
 
   ip->size = 0;
+  ip->ra_next = ip->ra_end = ip->ra_win = 0;
   iupdate(ip);
 }
 
@@ -364,6 +803,67 @@ void stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// 顺序读检测与预读，调用者需持有 ip->lock，n > 0
+// 连续读到新块的顺序读使窗口从 RA_MIN 倍增到 RA_MAX，随机读则关闭预读。
+// 本次读取范围内的后续块与窗口内的块一起异步提交，由磁盘并行处理
+static void readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn = off / BSIZE;
+  uint last = (off + n - 1) / BSIZE;
+  uint nblk = (ip->size + BSIZE - 1) / BSIZE;
+  uint start, end, i, j;
+  int q, nr;
+  struct extent r[RA_MAX];
+
+  // 预读的缓冲块要等完成中断才解锁，没有进程上下文时（如启动阶段的 fs_test）
+  // 随后的 bread() 碰到它只能 acquiresleep()，没法睡眠，所以不预读
+  if(myproc() == 0)
+    return;
+
+  // 读到了新的块才算一次顺序读，窗口增长；同一块内的小块读取
+  // （如逐项扫描目录）仍是顺序的，但窗口不变
+  if(bn == ip->ra_next || (bn + 1 == ip->ra_next && last > bn)){
+    if(ip->ra_win == 0)
+      ip->ra_win = RA_MIN;
+    else if(ip->ra_win < RA_MAX)
+      ip->ra_win = min(ip->ra_win * 2, RA_MAX);
+  } else if(bn + 1 != ip->ra_next){
+    ip->ra_win = 0;
+    ip->ra_end = 0;
+  }
+  ip->ra_next = last + 1;
+
+  start = bn + 1;
+  end = last + ip->ra_win;
+  if(start < ip->ra_end)
+    start = ip->ra_end;
+  if(end > nblk)
+    end = nblk;
+  if(start >= end)
+    return;
+
+  // 查找区间可能要读区间树的节点，会睡眠，所以先查好再 bplug()；
+  // 同一区间内的块物理上连续，在 bunplug() 时合并为一个请求。
+  // 碎片太多放不下时只预读前面一部分，其余留给下一次
+  for(i = start, nr = 0; i < end && nr < RA_MAX && ext_find(ip, i, &r[nr]); nr++){
+    if(r[nr].lblk < i){
+      r[nr].pblk += i - r[nr].lblk;
+      r[nr].len -= i - r[nr].lblk;
+      r[nr].lblk = i;
+    }
+    if(i + r[nr].len > end)
+      r[nr].len = end - i;
+    i += r[nr].len;
+  }
+  ip->ra_end = i;
+
+  q = bplug(ip->dev);
+  for(i = 0; i < nr; i++)
+    for(j = 0; j < r[i].len; j++)
+      bprefetch(ip->dev, r[i].pblk + j);
+  bunplug(ip->dev, q);
+}
+
 // Read data from inode.
 int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
@@ -374,6 +874,8 @@ int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(n > 0)
+    readahead(ip, off, n);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     uint addr = bmap(ip, off/BSIZE);
@@ -430,6 +932,410 @@ int namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+static uint dhash(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDHASH;
+}
+
+// 调用者需持有 dcache.lock
+static struct dentry* dfind(uint dev, uint dinum, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[dhash(dev, dinum, name)]; d; d = d->hnext)
+    if(d->dinum == dinum && d->dev == dev && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// 调用者需持有 dcache.lock
+static void dunhash(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = &dcache.hash[dhash(d->dev, d->dinum, d->name)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == d){
+      *pp = d->hnext;
+      break;
+    }
+  }
+  d->dinum = 0;
+  d->hnext = 0;
+}
+
+// 在缓存中查找 dp 下的 name：命中返回 1，否定项的 *inum 为 0；未命中返回 0
+static int dcache_lookup(struct inode *dp, char *name, uint *inum, uint *off)
+{
+  struct dentry *d;
+  int hit = 0;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp->dev, dp->inum, name)) != 0){
+    *inum = d->inum;
+    *off = d->off;
+    d->referenced = 1;
+    hit = 1;
+  }
+  release(&dcache.lock);
+  return hit;
+}
+
+// 记录 dp 下 name 对应 inum（inum 为 0 时记录不存在）
+static void dcache_enter(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+  uint h;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp->dev, dp->inum, name)) == 0){
+    for(;;){
+      d = &dcache.ent[dcache.hand];
+      dcache.hand = (dcache.hand + 1) % NDCACHE;
+      if(d->dinum == 0 || !d->referenced)
+        break;
+      d->referenced = 0;
+    }
+    d->referenced = 0;
+    if(d->dinum)
+      dunhash(d);
+    d->dev = dp->dev;
+    d->dinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    h = dhash(d->dev, d->dinum, d->name);
+    d->hnext = dcache.hash[h];
+    dcache.hash[h] = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  release(&dcache.lock);
+}
+
+// 删除目录项 dp/name 后调用，否则缓存会继续返回已删除的项。
+// 目前只有 fs_test 清理测试文件时删除目录项
+void dcache_remove(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp->dev, dp->inum, name)) != 0)
+    dunhash(d);
+  release(&dcache.lock);
+}
+
+// i节点被释放：去掉以它为父目录或指向它的项
+static void dcache_forget(struct inode *ip)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.ent; d < &dcache.ent[NDCACHE]; d++)
+    if(d->dinum && d->dev == ip->dev && (d->dinum == ip->inum || d->inum == ip->inum))
+      dunhash(d);
+  release(&dcache.lock);
+}
+
+// 索引目录中的目录项换了位置，去掉 dp 下缓存的项（它们记录的偏移已经不对）
+static void dcache_purge(struct inode *dp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.ent; d < &dcache.ent[NDCACHE]; d++)
+    if(d->dinum == dp->inum && d->dev == dp->dev)
+      dunhash(d);
+  release(&dcache.lock);
+}
+
+// 读索引目录 dp 的第 lbn 块。块号来自磁盘上的索引，越界说明索引坏了，
+// 不能交给 bmap() 去分配新块
+static struct buf* dx_bread(struct inode *dp, uint lbn)
+{
+  if(lbn >= dp->size / BSIZE)
+    panic("dx_bread: bad index");
+  return bread(dp->dev, bmap(dp, lbn));
+}
+
+// 在目录 dp 第 lbn 块的第 [from, to) 项中找 name，返回 i节点号，没有时返回 0
+static uint dirscan(struct inode *dp, uint lbn, int from, int to, char *name, uint *poff)
+{
+  struct buf *bp;
+  struct dirent *de;
+  uint inum = 0;
+  int i;
+
+  bp = dx_bread(dp, lbn);
+  de = (struct dirent*)bp->data;
+  for(i = from; i < to; i++){
+    if(de[i].inum && namecmp(name, de[i].name) == 0){
+      inum = de[i].inum;
+      *poff = lbn * BSIZE + i * sizeof(*de);
+      break;
+    }
+  }
+  brelse(bp);
+  return inum;
+}
+
+// 二分查找覆盖 hash h 的索引项
+static int dx_search(struct dx_entry *dx, uint h)
+{
+  int lo = 0, hi = dx[0].count - 1, mid;
+
+  while(lo < hi){
+    mid = (lo + hi + 1) / 2;
+    if(dx[mid].hash <= h)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// 在索引数组 dx 的第 k 项之后插入 (hash, block)，调用者保证还有空位
+static void dx_insert(struct dx_entry *dx, int k, uint hash, uint block)
+{
+  int n = dx[0].count;
+
+  memmove(&dx[k+2], &dx[k+1], (n - k - 1) * sizeof(*dx));
+  memset(&dx[k+1], 0, sizeof(*dx));
+  dx[k+1].hash = hash;
+  dx[k+1].block = block;
+  dx[0].count = n + 1;
+}
+
+// 在目录末尾加一个清零的块，返回它的缓冲区，*lbn 为逻辑块号
+static struct buf* dx_newblock(struct inode *dp, uint *lbn)
+{
+  uint addr;
+
+  *lbn = dp->size / BSIZE;
+  if((addr = bmap(dp, *lbn)) == 0)
+    return 0;
+  dp->size += BSIZE;
+  iupdate(dp);
+  return bread(dp->dev, addr);  // bmap() 分配的块已清零
+}
+
+// 索引目录中 hash 为 h 的名字所在的路径。根一直持有；有第二层时 node 为
+// 中间索引块，否则为 0。leaf 是叶子在 pdx（根或中间块）中的下标
+struct dx_path {
+  struct buf *root, *node;
+  struct dx_entry *rdx, *pdx;
+  int rk, leaf;
+};
+
+static void dx_walk(struct inode *dp, uint h, struct dx_path *p)
+{
+  p->root = dx_bread(dp, 0);
+  p->rdx = (struct dx_entry*)p->root->data + DX_FIRST;
+  p->rk = dx_search(p->rdx, h);
+  p->node = 0;
+  p->pdx = p->rdx;
+  if(p->rdx[0].levels){
+    p->node = dx_bread(dp, p->rdx[p->rk].block);
+    p->pdx = (struct dx_entry*)p->node->data;
+  }
+  p->leaf = dx_search(p->pdx, h);
+}
+
+static void dx_release(struct dx_path *p)
+{
+  if(p->node)
+    brelse(p->node);
+  brelse(p->root);
+}
+
+// 在索引目录中找 name：每层索引读一块，再读一个叶子
+static uint dx_lookup(struct inode *dp, char *name, uint *poff)
+{
+  struct dx_path p;
+  uint lbn;
+
+  if(namecmp(name, ".") == 0 || namecmp(name, "..") == 0)
+    return dirscan(dp, 0, 0, DX_FIRST, name, poff);
+
+  dx_walk(dp, dirhash(name), &p);
+  lbn = p.pdx[p.leaf].block;
+  dx_release(&p);
+  return dirscan(dp, lbn, 0, DPB, name, poff);
+}
+
+// 只占一块且已满的目录转为索引格式：原来的目录项（"." ".." 除外）搬到第 1 块，
+// 第 0 块只留 "." ".." 和一个覆盖全部 hash 的索引项
+static int dx_convert(struct inode *dp)
+{
+  struct buf *bp, *lp;
+  struct dirent *de;
+  struct dx_entry *dx;
+  uint addr;
+
+  bp = bread(dp->dev, bmap(dp, 0));
+  de = (struct dirent*)bp->data;
+  if(namecmp(de[0].name, ".") != 0 || namecmp(de[1].name, "..") != 0 ||
+     (addr = bmap(dp, 1)) == 0){
+    brelse(bp);
+    return -1;
+  }
+  lp = bread(dp->dev, addr);
+  memmove(lp->data, bp->data, BSIZE);
+  memset(lp->data, 0, DX_FIRST * sizeof(*de));
+  memset(bp->data + DX_FIRST * sizeof(*de), 0, BSIZE - DX_FIRST * sizeof(*de));
+  dx = (struct dx_entry*)bp->data + DX_FIRST;
+  dx[0].count = 1;
+  dx[0].hash = 0;
+  dx[0].block = 1;
+  log_write(lp);
+  log_write(bp);
+  brelse(lp);
+  brelse(bp);
+
+  dp->size = 2 * BSIZE;
+  dp->flags |= I_DXDIR;
+  iupdate(dp);
+  dcache_purge(dp);
+  return 0;
+}
+
+// 叶子 lp 满了：把 hash 较大的一半目录项搬到目录末尾的新叶子，返回新叶子的
+// 逻辑块号，*split 为其中最小的 hash。hash 相同的名字必须留在同一个叶子中，
+// 分不开时返回 0
+static uint dx_split_leaf(struct inode *dp, struct buf *lp, uint *split)
+{
+  struct dirent *de = (struct dirent*)lp->data, *nde;
+  struct buf *np;
+  uint hs[DPB], lbn;
+  uchar ord[DPB];
+  int i, j, m = -1;
+
+  // 按 hash 给目录项排序
+  for(i = 0; i < DPB; i++){
+    hs[i] = dirhash(de[i].name);
+    for(j = i; j > 0 && hs[ord[j-1]] > hs[i]; j--)
+      ord[j] = ord[j-1];
+    ord[j] = i;
+  }
+  // 从中间往两边找 hash 变化的位置作为分界
+  for(i = 0; i < DPB / 2 && m < 0; i++){
+    if(hs[ord[DPB/2 + i]] != hs[ord[DPB/2 + i - 1]])
+      m = DPB/2 + i;
+    else if(hs[ord[DPB/2 - i]] != hs[ord[DPB/2 - i - 1]])
+      m = DPB/2 - i;
+  }
+  if(m < 0)
+    return 0;
+  *split = hs[ord[m]];
+
+  if((np = dx_newblock(dp, &lbn)) == 0)
+    return 0;
+  nde = (struct dirent*)np->data;
+  for(i = j = 0; i < DPB; i++){
+    if(hs[i] >= *split){
+      nde[j++] = de[i];
+      memset(&de[i], 0, sizeof(de[i]));
+    }
+  }
+  log_write(np);
+  brelse(np);
+  log_write(lp);
+  return lbn;
+}
+
+// 路径 p 上的叶子满了，为它腾出地方：父索引块有空位就分裂叶子；
+// 否则只有一层时把根的项全部搬到一个中间索引块，让索引长出第二层；
+// 已有两层时把中间索引块对半分开。每次只做一步，调用者重新查找。
+// 无法再分时返回 -1
+static int dx_grow(struct inode *dp, struct dx_path *p)
+{
+  struct buf *lp, *np;
+  struct dx_entry *ndx;
+  uint lbn, split;
+  int n, max;
+
+  n = p->pdx[0].count;
+  max = p->node ? DX_NODE : DX_MAX;
+  if(n < max){
+    lp = dx_bread(dp, p->pdx[p->leaf].block);
+    lbn = dx_split_leaf(dp, lp, &split);
+    brelse(lp);
+    if(lbn == 0)
+      return -1;
+    dx_insert(p->pdx, p->leaf, split, lbn);
+    log_write(p->node ? p->node : p->root);
+  } else if(p->node == 0){
+    if((np = dx_newblock(dp, &lbn)) == 0)
+      return -1;
+    memmove(np->data, p->rdx, n * sizeof(*ndx));
+    ((struct dx_entry*)np->data)[0].levels = 0;
+    log_write(np);
+    brelse(np);
+    memset(p->rdx, 0, n * sizeof(*ndx));
+    p->rdx[0].count = 1;
+    p->rdx[0].block = lbn;
+    p->rdx[0].levels = 1;
+    log_write(p->root);
+  } else if(p->rdx[0].count < DX_MAX){
+    if((np = dx_newblock(dp, &lbn)) == 0)
+      return -1;
+    ndx = (struct dx_entry*)np->data;
+    memmove(ndx, &p->pdx[n/2], (n - n/2) * sizeof(*ndx));
+    ndx[0].count = n - n/2;
+    memset(&p->pdx[n/2], 0, (n - n/2) * sizeof(*ndx));
+    p->pdx[0].count = n/2;
+    dx_insert(p->rdx, p->rk, ndx[0].hash, lbn);
+    log_write(np);
+    brelse(np);
+    log_write(p->node);
+    log_write(p->root);
+  } else {
+    return -1;
+  }
+  dcache_purge(dp);
+  return 0;
+}
+
+// 在索引目录中加入目录项：只需读写一个叶子，叶子满时先腾出地方
+static int dx_link(struct inode *dp, char *name, uint inum)
+{
+  struct dx_path p;
+  struct buf *lp;
+  struct dirent *de;
+  uint h = dirhash(name), lbn;
+  int i;
+
+  for(;;){
+    dx_walk(dp, h, &p);
+    lbn = p.pdx[p.leaf].block;
+    lp = dx_bread(dp, lbn);
+    de = (struct dirent*)lp->data;
+    for(i = 0; i < DPB; i++)
+      if(de[i].inum == 0)
+        break;
+    if(i < DPB)
+      break;
+    brelse(lp);
+    if(dx_grow(dp, &p) < 0){
+      dx_release(&p);
+      return -1;
+    }
+    dx_release(&p);
+  }
+
+  memset(&de[i], 0, sizeof(de[i]));
+  strncpy(de[i].name, name, DIRSIZ);
+  de[i].inum = inum;
+  log_write(lp);
+  brelse(lp);
+  dx_release(&p);
+
+  dcache_enter(dp, name, inum, lbn * BSIZE + i * sizeof(*de));
+  return 0;
+}
+
 // Look for a directory entry in a directory.
 struct inode* dirlookup(struct inode *dp, char *name, uint *poff)
 {
@@ -439,6 +1345,24 @@ struct inode* dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dcache_lookup(dp, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  if(dp->flags & I_DXDIR){
+    inum = dx_lookup(dp, name, &off);
+    dcache_enter(dp, name, inum, off);
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -449,10 +1373,12 @@ struct inode* dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcache_enter(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcache_enter(dp, name, 0, 0);
   return 0;
 }
 
@@ -470,6 +1396,9 @@ int dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  if(dp->flags & I_DXDIR)
+    return dx_link(dp, name, inum);
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -478,10 +1407,17 @@ int dirlink(struct inode *dp, char *name, uint inum)
       break;
   }
 
+  // 第一块已满，目录要长出第二块时改用索引格式
+  if(off == BSIZE && dp->size == BSIZE && dx_convert(dp) == 0)
+    return dx_link(dp, name, inum);
+
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de)){
+    dcache_remove(dp, name);  // 否定项可能已经不对了
     return -1;
+  }
+  dcache_enter(dp, name, inum, off);
 
   return 0;
 }
@@ -15,10 +15,28 @@ struct superblock {
     uint bmapstart;    // 位图起始块号
 };
 
-#define FSMAGIC 0x10203040  // 文件系统魔数
-#define NDIRECT 12
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define FSMAGIC 0x10203041  // 文件系统魔数（区间映射格式）
+#define MAXFILE (0xffffffffU / BSIZE) // 文件最大块数，受 size（字节数）限制
+
+// 数据区间：逻辑块 [lblk, lblk+len) 映射到物理块 [pblk, pblk+len)。
+// 在区间树的内部节点中 pblk 是下一层节点的块号，lblk 是该子树的第一个逻辑块，len 不用
+struct extent {
+    uint lblk;
+    uint pblk;
+    uint len;
+};
+
+#define NEXTENT 4      // i节点中内嵌的区间树根的项数
+#define EXT_MAXDEPTH 4 // 区间树的最大深度
+
+// 区间树中根以外的节点，占一整块。项按 lblk 递增排列
+struct extent_block {
+    ushort n;             // 项数
+    ushort depth;         // 0 表示叶子，项是数据区间
+    struct extent e[(BSIZE - 4) / sizeof(struct extent)];
+};
+
+#define EXT_PER_BLOCK ((BSIZE - 4) / sizeof(struct extent))
 
 // on-disk inode structure
 struct dinode {
@@ -27,7 +45,10 @@ struct dinode {
     short minor;          // 次设备号（仅用于设备文件）
     short nlink;          // 硬链接数量
     uint size;            // 文件大小（以字节为单位）
-    uint addrs[NDIRECT+1]; // 数据块地址
+    ushort ext_n;         // 区间树根的项数
+    uchar ext_depth;      // 区间树深度，0 表示根中的项就是数据区间
+    uchar flags;          // I_DXDIR 等
+    struct extent ext[NEXTENT]; // 区间树的根
 };
 
 #define IPB (BSIZE / sizeof(struct dinode)) // 每块包含的 i节点数量
@@ -41,4 +62,37 @@ struct dinode {
 struct dirent {
     ushort inum;             // i节点号
     char name[DIRSIZ];       // 文件名
-};
\ No newline at end of file
+};
+
+#define DPB (BSIZE / sizeof(struct dirent)) // 每块包含的目录项数量
+
+// 大目录带散列索引（类似 ext3 的 htree）。只占一块的目录仍是目录项数组，
+// 需要第二块时转为索引格式：第 0 块是根索引块，前两项仍是 "." 和 ".."，
+// 之后是按 hash 递增排列的索引项；叶子仍是目录项数组。
+// 第 i 项覆盖 hash 在 [e[i].hash, e[i+1].hash) 的名字。根满了之后索引长出第二层：
+// 根的项指向中间索引块（整块都是索引项），中间索引块的项再指向叶子。
+// 索引项开头 2 字节为 0，按目录项数组读目录的代码把索引块看作空目录项
+#define I_DXDIR 0x1          // dinode.flags：目录带散列索引
+
+struct dx_entry {
+    ushort zero;             // 恒为 0，与 dirent.inum 重叠
+    ushort count;            // 仅第一项有效：本块中索引项数量
+    uint hash;               // 所指块中最小的 hash，第一项为 0
+    uint block;              // 所指块在目录中的逻辑块号
+    uint levels;             // 仅根的第一项有效：0 指向叶子，1 指向中间索引块
+};
+
+#define DX_FIRST 2                 // 根的第一个索引项在块中的位置（"." ".." 之后）
+#define DX_MAX   (DPB - DX_FIRST)  // 根索引项最大数量
+#define DX_NODE  DPB               // 中间索引块的索引项最大数量
+
+// 名字的 hash（FNV-1a），mkfs 与内核必须一致
+static inline uint dirhash(const char *name)
+{
+    uint h = 2166136261u;
+    int i;
+
+    for(i = 0; i < DIRSIZ && name[i]; i++)
+        h = (h ^ (uchar)name[i]) * 16777619u;
+    return h;
+}
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "type.h"
 #include "riscv.h"
 #include "def.h"
+#include "param.h"
 #include "stat.h"
 #include "spinlock.h"
 #include "sleeplock.h"
@@ -51,6 +52,397 @@ static struct inode* create(char *path, short type, short major, short minor)
   return ip;
 }
 
+static char tbuf[BSIZE];
+
+// 把文件 ip 的第 bn 块写成由 (tag, bn) 决定的内容，每块一个事务
+static int append_block(struct inode *ip, int tag, uint bn)
+{
+    int n;
+
+    memset(tbuf, tag * 31 + bn, BSIZE);
+    begin_op();
+    ilock(ip);
+    n = writei(ip, 0, (uint64)tbuf, bn * BSIZE, BSIZE);
+    iunlock(ip);
+    end_op();
+    return n == BSIZE ? 0 : -1;
+}
+
+// 检查文件 ip 前 nb 块的内容
+static int check_blocks(struct inode *ip, int tag, uint nb)
+{
+    uint bn;
+    int i, r = 0;
+
+    ilock(ip);
+    for(bn = 0; bn < nb && r == 0; bn++){
+        if(readi(ip, 0, (uint64)tbuf, bn * BSIZE, BSIZE) != BSIZE){
+            r = -1;
+            break;
+        }
+        for(i = 0; i < BSIZE; i++){
+            if((uchar)tbuf[i] != (uchar)(tag * 31 + bn)){
+                r = -1;
+                break;
+            }
+        }
+    }
+    iunlock(ip);
+    return r;
+}
+
+// 创建普通文件，返回未加锁的 i节点
+static struct inode* create_file(char *path)
+{
+    struct inode *ip;
+
+    begin_op();
+    if((ip = create(path, T_FILE, 0, 0)) != 0)
+        iunlock(ip);
+    end_op();
+    return ip;
+}
+
+// 删除 path 的目录项并把链接数减一，最后一个引用放掉时 iput() 释放 i节点和数据块。
+// 还没有 unlink 系统调用，测试用它清理自己创建的文件，免得下次启动时还在
+static int unlink(char *path)
+{
+    struct inode *ip, *dp;
+    struct dirent de;
+    char name[DIRSIZ];
+    uint off;
+
+    begin_op();
+    if((dp = nameiparent(path, name)) == 0){
+        end_op();
+        return -1;
+    }
+    ilock(dp);
+    if((ip = dirlookup(dp, name, &off)) == 0){
+        iunlockput(dp);
+        end_op();
+        return -1;
+    }
+    memset(&de, 0, sizeof(de));
+    if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("unlink: writei");
+    dcache_remove(dp, name);
+    iunlockput(dp);
+
+    ilock(ip);
+    ip->nlink--;
+    iupdate(ip);
+    iunlockput(ip);
+    end_op();
+    return 0;
+}
+
+#define EXT_NB 160
+
+// 区间树：两个文件交替追加，块不连续，根放不下时树要长高；
+// 清掉内存中的 i节点重新读入后映射不变；截断后区间全部释放
+static void test_extents(void)
+{
+    struct inode *a, *b;
+    uint bn;
+    int depth, n, ok;
+
+    printf("[TEST] Extent tree: interleaved appends of %d blocks\n", EXT_NB);
+    // 上次测试中途失败时文件还在，先删掉
+    unlink("/ext_a");
+    unlink("/ext_b");
+    if((a = create_file("/ext_a")) == 0 || (b = create_file("/ext_b")) == 0){
+        printf("[FAIL] Create failed\n");
+        return;
+    }
+    for(bn = 0; bn < EXT_NB; bn++){
+        if(append_block(a, 1, bn) < 0 || append_block(b, 2, bn) < 0){
+            printf("[FAIL] Append failed at block %d\n", bn);
+            return;
+        }
+    }
+    if(a->ext_depth == 0 || b->ext_depth == 0){
+        printf("[FAIL] Extent tree did not grow: depth %d %d\n", a->ext_depth, b->ext_depth);
+        return;
+    }
+    if(check_blocks(a, 1, EXT_NB) < 0 || check_blocks(b, 2, EXT_NB) < 0){
+        printf("[FAIL] Data mismatch\n");
+        return;
+    }
+    printf("[PASS] Depth %d/%d, data verified\n", a->ext_depth, b->ext_depth);
+
+    // 让 ilock() 重新从磁盘 i节点读入区间树的根
+    ilock(a);
+    depth = a->ext_depth;
+    n = a->ext_n;
+    a->valid = 0;
+    iunlock(a);
+    ilock(a);
+    ok = a->ext_depth == depth && a->ext_n == n;
+    iunlock(a);
+    if(!ok || check_blocks(a, 1, EXT_NB) < 0){
+        printf("[FAIL] Extent tree changed after reload\n");
+        return;
+    }
+    printf("[PASS] Extent tree reloaded from disk\n");
+
+    begin_op();
+    ilock(a);
+    itrunc(a);
+    ok = a->size == 0 && a->ext_n == 0 && a->ext_depth == 0;
+    ok = ok && readi(a, 0, (uint64)tbuf, 0, BSIZE) == 0;
+    iunlock(a);
+    end_op();
+    begin_op();
+    ilock(b);
+    itrunc(b);
+    iunlock(b);
+    end_op();
+    iput(a);
+    iput(b);
+    unlink("/ext_a");
+    unlink("/ext_b");
+    if(!ok){
+        printf("[FAIL] Truncate left extents behind\n");
+        return;
+    }
+    printf("[PASS] Truncated\n");
+}
+
+// 区间树中数据区间的个数
+static int count_extents(struct inode *ip, struct extent *e, int n, int depth)
+{
+    struct buf *bp;
+    struct extent_block *eb;
+    int i, total = 0;
+
+    if(depth == 0)
+        return n;
+    for(i = 0; i < n; i++){
+        bp = bread(ip->dev, e[i].pblk);
+        eb = (struct extent_block*)bp->data;
+        total += count_extents(ip, eb->e, eb->n, eb->depth);
+        brelse(bp);
+    }
+    return total;
+}
+
+// 分配器：交替追加的两个文件各自落在成倍增长的预留窗口中，区间数随块数
+// 对数增长；单独追加的文件紧接着上一块分配，只有一个区间
+static void test_reserve(void)
+{
+    struct inode *a, *b, *c;
+    uint bn;
+    int na, nb, nc;
+
+    printf("[TEST] Block reservation windows\n");
+    unlink("/rsv_a");
+    unlink("/rsv_b");
+    unlink("/rsv_c");
+    if((a = create_file("/rsv_a")) == 0 || (b = create_file("/rsv_b")) == 0 ||
+       (c = create_file("/rsv_c")) == 0){
+        printf("[FAIL] Create failed\n");
+        return;
+    }
+    for(bn = 0; bn < EXT_NB; bn++){
+        if(append_block(a, 3, bn) < 0 || append_block(b, 4, bn) < 0){
+            printf("[FAIL] Append failed at block %d\n", bn);
+            return;
+        }
+    }
+    for(bn = 0; bn < RSV_MAX / 2; bn++){
+        if(append_block(c, 5, bn) < 0){
+            printf("[FAIL] Append failed at block %d\n", bn);
+            return;
+        }
+    }
+    ilock(a);
+    na = count_extents(a, a->ext, a->ext_n, a->ext_depth);
+    iunlock(a);
+    ilock(b);
+    nb = count_extents(b, b->ext, b->ext_n, b->ext_depth);
+    iunlock(b);
+    ilock(c);
+    nc = count_extents(c, c->ext, c->ext_n, c->ext_depth);
+    iunlock(c);
+    iput(a);
+    iput(b);
+    iput(c);
+    unlink("/rsv_a");
+    unlink("/rsv_b");
+    unlink("/rsv_c");
+
+    // 窗口从 RSV_MIN 翻倍到 RSV_MAX，之后每 RSV_MAX 块一个区间，再留一点余量
+    if(na > 2 + EXT_NB / RSV_MAX + 6 || nb > 2 + EXT_NB / RSV_MAX + 6){
+        printf("[FAIL] Interleaved files fragmented: %d and %d extents\n", na, nb);
+        return;
+    }
+    if(nc != 1){
+        printf("[FAIL] Lone file has %d extents\n", nc);
+        return;
+    }
+    printf("[PASS] %d blocks each in %d and %d extents, lone file in 1\n", EXT_NB, na, nb);
+}
+
+// 创建目录，返回未加锁的 i节点
+static struct inode* create_dir(char *path)
+{
+    struct inode *dp;
+
+    begin_op();
+    if((dp = create(path, T_DIR, 0, 0)) != 0)
+        iunlock(dp);
+    end_op();
+    return dp;
+}
+
+// 在加锁的目录 dp 中查找 name，检查它指向 inum，且返回的偏移处确实是这一项
+static int lookup_check(struct inode *dp, char *name, uint inum)
+{
+    struct inode *ip;
+    struct dirent de;
+    uint off;
+    int ok;
+
+    if((ip = dirlookup(dp, name, &off)) == 0)
+        return -1;
+    ok = ip->inum == inum &&
+         readi(dp, 0, (uint64)&de, off, sizeof(de)) == sizeof(de) &&
+         de.inum == inum && namecmp(de.name, name) == 0;
+    iput(ip);
+    return ok ? 0 : -1;
+}
+
+// 目录项缓存：不存在的名字被缓存为否定项，dirlink() 之后必须能查到；
+// 缓存返回的偏移要和磁盘上的目录项一致
+static void test_dcache(void)
+{
+    struct inode *dp, *ip;
+    int r;
+
+    printf("[TEST] Directory entry cache\n");
+    unlink("/dc_dir");
+    if((dp = create_dir("/dc_dir")) == 0){
+        printf("[FAIL] Create failed\n");
+        return;
+    }
+    ilock(dp);
+    // 第二次查找命中否定项
+    if((ip = dirlookup(dp, "x", 0)) != 0 || (ip = dirlookup(dp, "x", 0)) != 0){
+        iput(ip);
+        iunlock(dp);
+        printf("[FAIL] Found a name that was never linked\n");
+        return;
+    }
+    iunlock(dp);
+
+    begin_op();
+    ilock(dp);
+    r = dirlink(dp, "x", ROOTINO);
+    iunlock(dp);
+    end_op();
+    if(r < 0){
+        printf("[FAIL] dirlink failed\n");
+        return;
+    }
+
+    ilock(dp);
+    r = lookup_check(dp, "x", ROOTINO);        // 缓存中的项
+    if(r == 0){
+        dcache_remove(dp, "x");
+        r = lookup_check(dp, "x", ROOTINO);    // 重新从目录块读
+    }
+    iunlock(dp);
+    begin_op();
+    ilock(dp);
+    if(r == 0 && dirlink(dp, "x", ROOTINO) == 0)
+        r = -1;                                // 重名必须被拒绝
+    iunlock(dp);
+    end_op();
+    iput(dp);
+    unlink("/dc_dir");
+    if(r < 0){
+        printf("[FAIL] Stale directory entry cache\n");
+        return;
+    }
+    printf("[PASS] Negative entry replaced by dirlink\n");
+}
+
+// name = prefix 后接 i 的十进制
+static void tname(char *name, char *prefix, int i)
+{
+    char d[12];
+    int n = 0;
+
+    while(*prefix)
+        *name++ = *prefix++;
+    do {
+        d[n++] = '0' + i % 10;
+        i /= 10;
+    } while(i > 0);
+    while(n > 0)
+        *name++ = d[--n];
+    *name = 0;
+}
+
+#define DX_NAMES 4000
+
+// 索引目录：第一块满后转为索引格式，叶子不断分裂，根满后索引长出第二层；
+// 每个名字都要能查到，偏移处就是这一项，"." ".." 仍在第 0 块
+static void test_dxdir(void)
+{
+    struct inode *dp;
+    struct dx_entry dx;
+    char name[DIRSIZ];
+    int i, r = 0;
+
+    printf("[TEST] Indexed directory with %d names\n", DX_NAMES);
+    unlink("/dx_dir");
+    if((dp = create_dir("/dx_dir")) == 0){
+        printf("[FAIL] Create failed\n");
+        return;
+    }
+    for(i = 0; i < DX_NAMES && r == 0; i++){
+        tname(name, "n", i);
+        begin_op();
+        ilock(dp);
+        r = dirlink(dp, name, ROOTINO);
+        iunlock(dp);
+        end_op();
+    }
+    if(r < 0){
+        printf("[FAIL] dirlink failed at name %d\n", i - 1);
+        iput(dp);
+        unlink("/dx_dir");
+        return;
+    }
+
+    ilock(dp);
+    if((dp->flags & I_DXDIR) == 0 ||
+       readi(dp, 0, (uint64)&dx, DX_FIRST * sizeof(struct dirent), sizeof(dx)) != sizeof(dx)){
+        printf("[FAIL] Directory not indexed\n");
+        r = -1;
+    } else if(dx.levels != 1){
+        printf("[FAIL] Index has %d levels, expected 2\n", dx.levels + 1);
+        r = -1;
+    }
+    for(i = 0; i < DX_NAMES && r == 0; i++){
+        tname(name, "n", i);
+        if((r = lookup_check(dp, name, ROOTINO)) < 0)
+            printf("[FAIL] Lookup of %s failed\n", name);
+    }
+    if(r == 0 && (lookup_check(dp, ".", dp->inum) < 0 || lookup_check(dp, "..", ROOTINO) < 0)){
+        printf("[FAIL] Lookup of . or .. failed\n");
+        r = -1;
+    }
+    i = dp->size / BSIZE;
+    iunlock(dp);
+    iput(dp);
+    unlink("/dx_dir");
+    if(r == 0)
+        printf("[PASS] All names found, directory has %d blocks\n", i);
+}
+
 void fs_test() {
     printf("\n=== Starting File System Test ===\n");
 
@@ -117,5 +509,39 @@ void fs_test() {
     // 在真实场景中，unlink 会移除目录项，这里我们只是释放内存中的 inode 引用
     iput(ip); 
 
+    test_extents();
+    test_reserve();
+    test_dcache();
+    test_dxdir();
+
     printf("=== File System Test Completed ===\n\n");
-}
\ No newline at end of file
+}
+
+#define BENCH_N 256
+
+// 磁盘驱动基准：分别以队列深度 1 和 8 读 BENCH_N 个块，打印每个请求平均的 time 计数。
+// 编译时加 -DDISK_BENCH 在启动时运行。驱动在设备支持时使用紧凑环（make run PACKED=1），
+// 加 -DVIRTIO_FORCE_SPLIT 重新编译即可在同一负载下对比分离环
+void disk_bench(void) {
+    static struct buf bb[8];// 不在缓冲区缓存中，直接交给驱动
+    int depth, i, j;
+    uint64 t0, t;
+
+    printf("\n=== Disk benchmark ===\n");
+    for(depth = 1; depth <= 8; depth *= 8){
+        t0 = read_time();
+        for(i = 0; i < BENCH_N; i += depth){
+            // 块号间隔 2，避免驱动把请求合并
+            for(j = 0; j < depth; j++){
+                bb[j].dev = VIRTIODEV;
+                bb[j].blockno = ((i + j) * 2) % FSSIZE;
+                virtio_disk_submit(&bb[j], 0);
+            }
+            for(j = 0; j < depth; j++)
+                virtio_disk_wait(&bb[j]);
+        }
+        t = read_time() - t0;
+        printf("[BENCH] depth %d: %d reads, %d ticks per read\n", depth, BENCH_N, (int)(t / BENCH_N));
+    }
+    iosched_dump();
+}
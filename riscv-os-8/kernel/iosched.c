@@ -0,0 +1,186 @@
+#include "type.h"
+#include "riscv.h"
+#include "def.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "bdev.h"
+#include "iosched.h"
+
+#define NIOQ (NBDEV * NCPU)
+
+static struct ioq *ioqs[NIOQ];// 所有队列，用于输出统计
+static int nioq;
+
+void ioq_init(struct ioq *q, char *name, struct iosched_ops *ops)
+{
+  memset(q, 0, sizeof(*q));
+  q->name = name;
+  q->ops = ops;
+  if(nioq < NIOQ)
+    ioqs[nioq++] = q;
+}
+
+void ioq_add(struct ioq *q, struct buf *b)
+{
+  b->qnext = 0;
+  b->qtime = read_time();
+  q->ops->add(q, b);
+  q->sel = 0;
+  q->nadd++;
+  if(++q->depth > q->maxdepth)
+    q->maxdepth = q->depth;
+}
+
+int ioq_empty(struct ioq *q)
+{
+  return q->head == 0;
+}
+
+struct buf *ioq_peek(struct ioq *q, int maxseg, int *nseg)
+{
+  if(q->head == 0)
+    return 0;
+  q->sel = q->ops->peek(q, maxseg, nseg);
+  q->selnseg = *nseg;
+  return q->sel;
+}
+
+// 取出最近一次 ioq_peek() 选中的请求，各块仍用 qnext 串起，最后一块的 qnext 为 0
+struct buf *ioq_take(struct ioq *q)
+{
+  struct buf *b = q->sel, *last = b;
+
+  if(b == 0)
+    panic("ioq_take");
+  for(int i = 1; i < q->selnseg; i++)
+    last = last->qnext;
+
+  if(q->selprev)
+    q->selprev->qnext = last->qnext;
+  else
+    q->head = last->qnext;
+  if(q->tail == last)
+    q->tail = q->selprev;
+  last->qnext = 0;
+
+  q->last = last->blockno;
+  q->depth -= q->selnseg;
+  q->ndispatch++;
+  q->nmerge += q->selnseg - 1;
+  q->sel = 0;
+  return b;
+}
+
+// 从 b 开始，沿链表数出块号连续、方向相同的块数
+static int run_length(struct buf *b, int maxseg)
+{
+  int n = 1;
+
+  while(n < maxseg && b->qnext &&
+        b->qnext->write == b->write &&
+        b->qnext->dev == b->dev &&
+        b->qnext->blockno == b->blockno + 1){
+    b = b->qnext;
+    n++;
+  }
+  return n;
+}
+
+// noop：按到达顺序下发，只合并相邻到达的连续块
+
+static void noop_add(struct ioq *q, struct buf *b)
+{
+  if(q->tail)
+    q->tail->qnext = b;
+  else
+    q->head = b;
+  q->tail = b;
+}
+
+static struct buf *noop_peek(struct ioq *q, int maxseg, int *nseg)
+{
+  q->selprev = 0;
+  *nseg = run_length(q->head, maxseg);
+  return q->head;
+}
+
+struct iosched_ops iosched_noop = {
+  .name = "noop",
+  .add = noop_add,
+  .peek = noop_peek,
+};
+
+// deadline：队列按块号排序，按单向电梯（C-SCAN）从上次的位置向后下发，
+// 排序后块号连续的请求自然相邻，可以合并。排队超过 READ_EXPIRE/WRITE_EXPIRE
+// 的请求优先下发，防止远处的请求饿死
+
+static void deadline_add(struct ioq *q, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &q->head; *pp && (*pp)->blockno < b->blockno; pp = &(*pp)->qnext)
+    ;
+  b->qnext = *pp;
+  *pp = b;
+}
+
+static struct buf *deadline_peek(struct ioq *q, int maxseg, int *nseg)
+{
+  struct buf *b, *prev, *sel = 0, *selprev = 0, *old = 0, *oldprev = 0;
+  struct buf *run = 0, *runprev = 0, *oldest = 0;
+  uint64 now = read_time();
+
+  // 一遍扫描；run 是 b 所在的连续块段的第一块，选中 b 时改从 run 开始，
+  // 前面紧邻的连续块一起下发（向前合并）
+  for(prev = 0, b = q->head; b; prev = b, b = b->qnext){
+    if(prev == 0 || prev->blockno + 1 != b->blockno ||
+       prev->write != b->write || prev->dev != b->dev){
+      run = b;
+      runprev = prev;
+    }
+    if(oldest == 0 || b->qtime < oldest->qtime){
+      oldest = b;
+      old = run;
+      oldprev = runprev;
+    }
+    if(sel == 0 && b->blockno > q->last){
+      sel = run;
+      selprev = runprev;
+    }
+  }
+
+  if(now - oldest->qtime > (oldest->write ? WRITE_EXPIRE : READ_EXPIRE)){
+    // 最老的请求已超时，从它开始（电梯也移到这里）
+    sel = old;
+    selprev = oldprev;
+    q->nexpire++;
+  } else if(sel == 0){
+    // 到达末尾，回到块号最小处
+    sel = q->head;
+    selprev = 0;
+  }
+
+  q->selprev = selprev;
+  *nseg = run_length(sel, maxseg);
+  return sel;
+}
+
+struct iosched_ops iosched_deadline = {
+  .name = "deadline",
+  .add = deadline_add,
+  .peek = deadline_peek,
+};
+
+// 输出所有调度队列的统计
+void iosched_dump(void)
+{
+  for(int i = 0; i < nioq; i++){
+    struct ioq *q = ioqs[i];
+    printf("iosched %s (%s): depth %d max %d, %d blocks in %d requests, %d merged, %d expired\n",
+           q->name, q->ops->name, q->depth, q->maxdepth, (int)q->nadd,
+           (int)q->ndispatch, (int)q->nmerge, (int)q->nexpire);
+  }
+}
@@ -0,0 +1,50 @@
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+// I/O 调度器：位于 bio.c 与块设备驱动之间，决定排队请求的下发顺序
+// 并把相邻块合并为一个请求。调用者负责给队列加锁
+
+struct ioq;
+
+struct iosched_ops {
+  char *name;
+  // 加入一个请求
+  void (*add)(struct ioq *q, struct buf *b);
+  // 选出下一个要下发的请求：返回第一个块，*nseg 为可合并的块数（不超过 maxseg）。
+  // 只选不取，ioq_take() 才从队列中移除
+  struct buf *(*peek)(struct ioq *q, int maxseg, int *nseg);
+};
+
+struct ioq {
+  struct iosched_ops *ops;
+  char *name;
+  struct buf *head;   // noop: 到达顺序；deadline: 按块号排序，都用 qnext 串起
+  struct buf *tail;   // noop 使用
+  struct buf *sel;    // peek 选中的第一个块
+  struct buf *selprev;// sel 在链表中的前一个，sel 是表头时为 0
+  int selnseg;
+  uint last;          // deadline: 电梯当前位置（上次下发的最后一个块号）
+
+  // 统计
+  int depth;          // 当前排队的块数
+  int maxdepth;       // 排队块数的最大值
+  uint64 nadd;        // 加入的块数
+  uint64 ndispatch;   // 下发的请求数
+  uint64 nmerge;      // 被合并进其他请求的块数
+  uint64 nexpire;     // 因超时而优先下发的请求数
+};
+
+extern struct iosched_ops iosched_noop;
+extern struct iosched_ops iosched_deadline;
+
+// 块设备默认使用的调度器，编译时加 -DIOSCHED_NOOP 改用 noop
+#ifdef IOSCHED_NOOP
+#define IOSCHED_DEFAULT (&iosched_noop)
+#else
+#define IOSCHED_DEFAULT (&iosched_deadline)
+#endif
+
+#define READ_EXPIRE   500000  // 读请求最长排队时间（time 计数，qemu 上 50ms）
+#define WRITE_EXPIRE 2500000  // 写请求最长排队时间
+
+#endif // IOSCHED_H
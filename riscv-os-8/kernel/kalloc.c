@@ -1,93 +1,404 @@
 #include "def.h"
 #include "type.h"
+#include "param.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "proc.h"
 
-struct spinlock ref_Lock;//保护引用计数
-int ref_count[PHYSTOP/PGSIZE];
+#define PCP_BATCH 16 // 每次在本地缓存与全局链表之间搬运的页数
+#define PCP_HIGH  64 // 本地缓存页数上限，超过后批量归还全局链表
 
+#define MAXORDER  11 // 伙伴系统支持的阶数：0 .. MAXORDER-1，最大块 4 MiB
+#define BLKSIZE(order) ((uint64)PGSIZE << (order))
+
+#define ZPOOL_HIGH 64 // 预清零页池的目标页数
+#define ZPOOL_LOW  16 // 低于该值时唤醒 kzerod 补充
+
+#define PG_BUDDY 0x1 // 块首页，挂在伙伴系统的 free_area 中
+#define PG_ZERO  0x2 // 页在预清零池中，内容全为 0
+
+// 物理页描述符，只覆盖 [mem_start, PHYSTOP)，数组本身放在 end 之后
 struct page{
-    struct page *next;
+    struct page *next;// 空闲链表（伙伴链表或本地缓存）
+    struct page *prev;
+    int refcnt;// 引用计数，使用原子指令（amoadd）更新
+    uchar order;// 块首页记录该块的阶
+    uchar flags;// PG_*
 };
 
+static struct page *pages;// 描述符数组
+static uint64 mem_start;// 第一个可分配的物理页
+static uint64 npage;// 可分配的物理页数
+
 struct {
-    struct spinlock lock;// 保护空闲链表
-    struct page *free_list;
+    struct spinlock lock;// 保护伙伴系统的空闲链表
+    struct page *free_area[MAXORDER];// 每一阶的空闲块链表
+    uint64 nfree;// 伙伴系统中的空闲页数
 } kmem;
 
+// 每个 hart 私有的空闲页缓存（magazine），只在关中断时访问，无需加锁
+struct kcache{
+    struct page *free_list;
+    int count;
+} kcache[NCPU];
+
+// 预清零页池，由内核线程 kzerod 在后台补充
+struct {
+    struct spinlock lock;
+    struct page *list;
+    int count;
+} zpool;
+
 extern char end[]; //kernel.ld中定义的end符号
 
+static inline struct page *pa2page(uint64 pa){
+    return &pages[(pa - mem_start) / PGSIZE];
+}
+
+static inline uint64 page2pa(struct page *pg){
+    return mem_start + (uint64)(pg - pages) * PGSIZE;
+}
+
 void kref_inc(void* pa){
-    acquire(&ref_Lock);
-    ref_count[(uint64)pa/PGSIZE]++;
-    release(&ref_Lock);
+    __sync_fetch_and_add(&pa2page((uint64)pa)->refcnt, 1);
+}
+
+// 读取物理页当前的引用计数
+int kref_get(void *pa){
+    return __atomic_load_n(&pa2page((uint64)pa)->refcnt, __ATOMIC_ACQUIRE);
+}
+
+// 原子地减少引用计数，返回减少后的值
+static int kref_dec(void *pa){
+    int r = __sync_sub_and_fetch(&pa2page((uint64)pa)->refcnt, 1);
+    if(r < 0)
+        panic("kref_dec: ref_count < 0");
+    return r;
+}
+
+static void area_push(int order, struct page *p){
+    p->prev = 0;
+    p->next = kmem.free_area[order];
+    if(p->next)
+        p->next->prev = p;
+    kmem.free_area[order] = p;
+    p->flags |= PG_BUDDY;
+    p->order = order;
+    kmem.nfree += 1 << order;
+}
+
+static void area_remove(int order, struct page *p){
+    if(p->prev)
+        p->prev->next = p->next;
+    else
+        kmem.free_area[order] = p->next;
+    if(p->next)
+        p->next->prev = p->prev;
+    p->flags &= ~PG_BUDDY;
+    kmem.nfree -= 1 << order;
+}
+
+// 从伙伴系统取一个 2^order 页的块，必要时拆分更大的块，调用者需持有 kmem.lock
+static struct page *buddy_alloc(int order){
+    int k;
+    struct page *p;
+
+    for(k = order; k < MAXORDER; k++){
+        if(kmem.free_area[k])
+            break;
+    }
+    if(k == MAXORDER)
+        return 0;
+
+    p = kmem.free_area[k];
+    area_remove(k, p);
+
+    // 把多余的上半部分逐级挂回对应阶的链表
+    while(k > order){
+        k--;
+        area_push(k, p + (1 << k));
+    }
+    p->order = order;
+    return p;
+}
+
+// 归还一个 2^order 页的块，并尽可能与伙伴合并，调用者需持有 kmem.lock
+static void buddy_free(uint64 pa, int order){
+    while(order < MAXORDER - 1){
+        uint64 buddy = pa ^ BLKSIZE(order);
+        if(buddy < mem_start || buddy >= PHYSTOP)
+            break;
+        struct page *bp = pa2page(buddy);
+        if(!(bp->flags & PG_BUDDY) || bp->order != order)
+            break;
+        area_remove(order, bp);
+        pa &= ~BLKSIZE(order);
+        order++;
+    }
+    area_push(order, pa2page(pa));
 }
 
 void pmm_init(void){
 
     initlock(&kmem.lock, "kmem");
-    initlock(&ref_Lock, "ref_count_lock");
-    char *p = (char *)PGROUNDUP((uint64) end);//page align
-    char *pa_end = (char *)PHYSTOP;
-    for(;p + PGSIZE <= pa_end;p += PGSIZE){
-        ref_count[(uint64)p / PGSIZE] = 1; 
-        kfree(p);
-    } 
+    initlock(&zpool.lock, "zpool");
+
+    // 描述符数组紧跟在内核之后，只为其后的可分配内存建立描述符
+    uint64 p = PGROUNDUP((uint64) end);//page align
+    pages = (struct page *)p;
+    mem_start = PGROUNDUP(p + (PHYSTOP - p) / PGSIZE * sizeof(struct page));
+    npage = (PHYSTOP - mem_start) / PGSIZE;
+    memset(pages, 0, npage * sizeof(struct page));
+
+    // 启动时按最大的自然对齐块切分 [mem_start, PHYSTOP)，直接挂入伙伴系统
+    p = mem_start;
+    while(p + PGSIZE <= PHYSTOP){
+        int order = MAXORDER - 1;
+        while(order > 0 && ((p & (BLKSIZE(order) - 1)) != 0 || p + BLKSIZE(order) > PHYSTOP))
+            order--;
+        area_push(order, pa2page(p));
+        p += BLKSIZE(order);
+    }
+}
+
+// 从伙伴系统批量取页填充本地缓存，调用者需关中断
+static void pcp_refill(struct kcache *c){
+    struct page *r;
+
+    acquire(&kmem.lock);
+    while(c->count < PCP_BATCH && (r = buddy_alloc(0)) != 0){
+        r -> next = c->free_list;
+        c->free_list = r;
+        c->count++;
+    }
+    release(&kmem.lock);
+}
+
+// 将本地缓存中至多 n 页归还伙伴系统，调用者需关中断
+static void pcp_drain(struct kcache *c, int n){
+    struct page *r;
+
+    acquire(&kmem.lock);
+    for(int i = 0; i < n && (r = c->free_list) != 0; i++){
+        c->free_list = r -> next;
+        c->count--;
+        buddy_free(page2pa(r), 0);
+    }
+    release(&kmem.lock);
 }
 
 void kfree(char *pa){
     struct page *r;
-    if(((uint64)pa % PGSIZE) != 0 || (char *)pa < end || (uint64)pa >= PHYSTOP){
+    struct kcache *c;
+    if(((uint64)pa % PGSIZE) != 0 || (uint64)pa < mem_start || (uint64)pa >= PHYSTOP){
         printf("KFREE ERROR: pa=%x\n", pa);
         panic("kfree");
     }
-    
-    acquire(&ref_Lock);
-    int idx = (uint64)pa / PGSIZE;
-    if(ref_count[idx] <= 0){
-        release(&ref_Lock);
-        panic("kfree: ref_count <= 0");
-    }
-
-    ref_count[idx]--;
 
-    if(ref_count[idx] > 0){
+    if(kref_dec(pa) > 0){
         // 还有引用，不能释放物理页
-        release(&ref_Lock);
         return;
     }
 
-    release(&ref_Lock);
-
+#ifdef KALLOC_DEBUG
     memset(pa, 1, PGSIZE);// fill with junk
-    r = (struct page *)pa;
+#endif
+    r = pa2page((uint64)pa);
 
-    acquire(&kmem.lock);
-    r -> next = kmem.free_list;
-    kmem.free_list = r;
-    release(&kmem.lock);
+    // 先放入本地缓存，缓存过满时才批量归还伙伴系统
+    push_off();
+    c = &kcache[cpuid()];
+    r -> next = c->free_list;
+    c->free_list = r;
+    c->count++;
+    if(c->count > PCP_HIGH)
+        pcp_drain(c, PCP_BATCH);
+    pop_off();
 }
 
-void *alloc(void){
+// 从本 hart 的缓存取一页，不动用预清零池
+static void *pcp_alloc(void){
     struct page *r;
+    struct kcache *c;
+    char *pa;
 
-    acquire(&kmem.lock);
+    // 常见路径只访问本 hart 的缓存，缓存空了才去伙伴系统批量补充
+    push_off();
+    c = &kcache[cpuid()];
+    if(c->free_list == 0)
+        pcp_refill(c);
 
-    r = kmem.free_list;
+    r = c->free_list;
     if(r){
-        kmem.free_list = r -> next;
+        c->free_list = r -> next;
+        c->count--;
     }
+    pop_off();
 
-    release(&kmem.lock);
+    if(r == 0)
+        return 0;
+
+    pa = (char *)page2pa(r);
+#ifdef KALLOC_DEBUG
+    memset(pa, 5, PGSIZE);// fill with junk
+#endif
+
+    // 空闲页只属于分配器，没有其他引用者，直接置 1 无需原子操作
+    r->refcnt = 1;
+
+    return (void *)pa;
+}
 
+// 调用者可能持有自旋锁（如 allocproc 持有新进程的 p->lock），此时 wakeup
+// 会对同一把锁重复加锁；只在不持有任何自旋锁的进程上下文中唤醒 kzerod，
+// 否则留给下一次分配
+static int can_wakeup(void){
+    int ok;
+
+    push_off();
+    ok = mycpu()->noff == 1 && mycpu()->proc != 0;
+    pop_off();
+    return ok;
+}
+
+// 从预清零池取一页，池空时返回 0
+static void *zpool_take(void){
+    struct page *r;
+    int low;
+
+    acquire(&zpool.lock);
+    r = zpool.list;
     if(r){
-        memset((char *)r, 5, PGSIZE);// fill with junk
+        zpool.list = r->next;
+        zpool.count--;
+        r->flags &= ~PG_ZERO;
+    }
+    low = zpool.count < ZPOOL_LOW;
+    release(&zpool.lock);
+
+    if(low && can_wakeup())
+        wakeup(&zpool);
+
+    return r ? (void *)page2pa(r) : 0;
+}
+
+void *alloc(void){
+    void *pa = pcp_alloc();
+
+    // 内存紧张时，预清零池中的页也可以直接拿来用
+    if(pa == 0)
+        pa = zpool_take();
+    return pa;
+}
+
+// 分配一页内容全为 0 的物理页，优先使用 kzerod 预先清零的页
+void *alloc_zeroed(void){
+    void *pa = zpool_take();
+
+    if(pa == 0 && (pa = pcp_alloc()) != 0)
+        zero_page(pa);
+    return pa;
+}
+
+// 后台内核线程：保持预清零池中有 ZPOOL_HIGH 页可用
+void kzerod(void){
+    char *pa;
+    struct page *r;
+
+    for(;;){
+        acquire(&zpool.lock);
+        while(zpool.count >= ZPOOL_HIGH)
+            sleep(&zpool, &zpool.lock);
+        release(&zpool.lock);
 
-        // 初始化引用计数为1
-        acquire(&ref_Lock);
-        ref_count[(uint64)r / PGSIZE] = 1;
-        release(&ref_Lock);
+        if((pa = pcp_alloc()) == 0){
+            // 没有空闲内存，等下一次池子被取用时再试
+            acquire(&zpool.lock);
+            sleep(&zpool, &zpool.lock);
+            release(&zpool.lock);
+            continue;
+        }
+        zero_page(pa);
+
+        r = pa2page((uint64)pa);
+        acquire(&zpool.lock);
+        r->flags |= PG_ZERO;
+        r->next = zpool.list;
+        zpool.list = r;
+        zpool.count++;
+        release(&zpool.lock);
+    }
+}
+
+// 分配 2^order 个物理连续的页，首地址按块大小自然对齐
+void *alloc_pages(int order){
+    struct page *r;
+    struct kcache *c;
+    void *pa;
+
+    if(order == 0)
+        return alloc();
+    if(order < 0 || order >= MAXORDER)
+        return 0;
+
+    acquire(&kmem.lock);
+    r = buddy_alloc(order);
+    release(&kmem.lock);
+
+    if(r == 0){
+        // 本地缓存中的零散页会妨碍合并，全部归还后再试一次
+        push_off();
+        c = &kcache[cpuid()];
+        pcp_drain(c, c->count);
+        pop_off();
+        acquire(&kmem.lock);
+        r = buddy_alloc(order);
+        release(&kmem.lock);
+    }
+
+    if(r == 0)
+        return 0;
+
+    pa = (void *)page2pa(r);
+#ifdef KALLOC_DEBUG
+    memset(pa, 5, BLKSIZE(order));// fill with junk
+#endif
+    r->refcnt = 1;
+    return pa;
+}
+
+// 释放 alloc_pages 分配的块，order 必须与分配时一致
+void free_pages(void *pa, int order){
+    if(order == 0){
+        kfree(pa);
+        return;
     }
+    if(order < 0 || order >= MAXORDER || ((uint64)pa & (BLKSIZE(order) - 1)) != 0 ||
+       (uint64)pa < mem_start || (uint64)pa >= PHYSTOP)
+        panic("free_pages");
+    if(pa2page((uint64)pa)->order != order)
+        panic("free_pages: order mismatch");
 
-    return (void *)r;
+    if(kref_dec(pa) > 0)
+        return;
+
+#ifdef KALLOC_DEBUG
+    memset(pa, 1, BLKSIZE(order));// fill with junk
+#endif
+
+    acquire(&kmem.lock);
+    buddy_free((uint64)pa, order);
+    release(&kmem.lock);
+}
+
+// 当前空闲的物理页数（伙伴系统与各 hart 缓存之和），用于按内存大小配置缓存
+uint64 pmm_freepages(void){
+    uint64 n;
+
+    acquire(&kmem.lock);
+    n = kmem.nfree;
+    release(&kmem.lock);
+    for(int i = 0; i < NCPU; i++)
+        n += kcache[i].count;
+    return n;
 }
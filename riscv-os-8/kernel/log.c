@@ -18,8 +18,16 @@ struct log{
     int start;
     int outstanding; // how many FS syscalls are executing.
     int committing;  // in commit(), please wait.
+    int thread;      // logd is running; commits happen there
+    int ncommit;     // number of completed commits, for log_sync()
+    int cleared;     // 清空的日志头还没有 flush 到磁盘
     int dev;
     struct logheader lh;
+    // 本批事务释放的块区间，提交之后再 discard；提交之前它们在磁盘上
+    // 仍属于原来的文件。区间用完时 overflow 置 1，之后释放的块不再记录
+    struct { uint start, n; } freed[NFREED];
+    int nfreed;
+    int overflow;
 } log;
 
 static void recover_from_log(void);
@@ -36,22 +44,34 @@ void initlog(int dev, struct superblock *sb){
     recover_from_log();
 }
 
-// 从日志中恢复数据
+// 把日志中的块写回它们在文件系统中的位置，所有写请求并行发出
 static void install_trans(int recovering){
-    int tail;
+    struct buf *dbuf[LOGBLOCKS];
+    int tail, q;
+
+    for (tail = 0; tail < log.lh.n; tail++) {
+        if(recovering) {
+            // 崩溃恢复时缓存中没有数据，从日志中取，目标块不必先读
+            dbuf[tail] = bgetblk(log.dev, log.lh.block[tail]);
+            printf("recovering tail %d dst %d\n", tail, log.lh.block[tail]);
+            struct buf *lbuf = bread(log.dev, log.start+tail+1);
+            memmove(dbuf[tail]->data, lbuf->data, BSIZE);
+            brelse(lbuf);
+        } else {
+            // 正常提交时缓存中被钉住的块就是最新内容，直接写回
+            dbuf[tail] = bread(log.dev, log.lh.block[tail]);
+        }
+    }
+    q = bplug(log.dev);
+    for (tail = 0; tail < log.lh.n; tail++)
+        bwrite_async(dbuf[tail]);
+    bunplug(log.dev, q);
     for (tail = 0; tail < log.lh.n; tail++) {
-    if(recovering) {
-      printf("recovering tail %d dst %d\n", tail, log.lh.block[tail]);
+        bwait(dbuf[tail]);
+        if(recovering == 0)
+            bunpin(dbuf[tail]);
+        brelse(dbuf[tail]);
     }
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); 
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); 
-    memmove(dbuf->data, lbuf->data, BSIZE); 
-    bwrite(dbuf);  
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
-  }
 }
 
 // Read the log header from disk into the in-memory log header
@@ -79,12 +99,21 @@ static void write_head(){
   brelse(buf);
 }
 
+// 写屏障：此前完成的写请求都已落盘之后才能继续
+static void log_barrier(){
+    if(bflush(log.dev) < 0)
+        panic("log: flush");
+}
+
 // 从日志中恢复数据
 static void recover_from_log(void){
     read_head();
     install_trans(1); // recovering = 1
+    if(log.lh.n > 0)
+        log_barrier();
     log.lh.n = 0;
     write_head();
+    log.cleared = 1;
 }
 
 // 开始一个文件系统操作
@@ -104,6 +133,8 @@ void begin_op(void){
 }
 
 // 结束一个文件系统操作
+// logd 运行后由它批量提交，多个事务合并为一次日志提交；
+// 启动阶段或没有进程上下文时仍在这里同步提交
 void end_op(void){
     int do_commit = 0;
 
@@ -111,10 +142,12 @@ void end_op(void){
     log.outstanding--;
     if(log.committing)
         panic("end_op: log.committing");
-    if(log.outstanding == 0){
+    if(log.outstanding == 0 && (!log.thread || myproc() == 0)){
         do_commit = 1;
         log.committing = 1;
     } else {
+        if(log.outstanding == 0 && log.lh.n > 0)
+            wakeup(&log.lh);
         wakeup(&log);
     }
     release(&log.lock);
@@ -124,33 +157,168 @@ void end_op(void){
         commit();
         acquire(&log.lock);
         log.committing = 0;
+        log.ncommit++;
         wakeup(&log);
         release(&log.lock);
     }
 }
 
+// 日志提交线程：等没有进行中的事务时，把已结束的事务一次提交
+void logd(void){
+    acquire(&log.lock);
+    log.thread = 1;
+    for(;;){
+        while(log.outstanding > 0 || log.lh.n == 0)
+            sleep(&log.lh, &log.lock);
+        log.committing = 1;
+        release(&log.lock);
+
+        commit();
+
+        acquire(&log.lock);
+        log.committing = 0;
+        log.ncommit++;
+        wakeup(&log);
+    }
+}
+
+// 等待此前结束的所有事务都已提交到磁盘（fsync 语义）
+// 不能在 begin_op/end_op 之间调用
+void log_sync(void){
+    int target;
+
+    acquire(&log.lock);
+    if(log.lh.n > 0 && log.thread && myproc() != 0){
+        // 正在提交的和尚未提交的事务都在 log.lh 中，下一次提交完成即可
+        target = log.ncommit + 1;
+        wakeup(&log.lh);
+        while(log.ncommit < target)
+            sleep(&log, &log.lock);
+    }
+    release(&log.lock);
+}
+
 // Copy modified blocks from cache to log.
+// 日志块会被整块覆盖，不必先读盘；日志区是连续的，
+// 所有写请求一起提交，合并成少数几个大请求
 static void write_log(){
-    int tail;
+    struct buf *to[LOGBLOCKS];
+    int tail, q;
+
     for(tail = 0; tail < log.lh.n; tail++){
-        struct buf *to = bread(log.dev, log.start + tail + 1);
+        to[tail] = bgetblk(log.dev, log.start + tail + 1);
         struct buf *from = bread(log.dev, log.lh.block[tail]);
-        memmove(to->data, from->data, BSIZE);
-        bwrite(to);
+        memmove(to[tail]->data, from->data, BSIZE);
         brelse(from);
-        brelse(to);
+    }
+    q = bplug(log.dev);
+    for(tail = 0; tail < log.lh.n; tail++)
+        bwrite_async(to[tail]);
+    bunplug(log.dev, q);
+    for(tail = 0; tail < log.lh.n; tail++){
+        bwait(to[tail]);
+        brelse(to[tail]);
     }
 }
 
+// 释放已经提交，把这些块 discard 掉；设备不支持时什么也不做
+static void discard_freed(){
+    int i;
+
+    for(i = 0; i < log.nfreed; i++)
+        if(bdiscard(log.dev, log.freed[i].start, log.freed[i].n) < 0)
+            break;
+    acquire(&log.lock);
+    log.nfreed = 0;
+    log.overflow = 0;
+    release(&log.lock);
+}
+
 // Commit a log transaction
+// 设备有写缓存时写请求完成只表示进入了缓存，各步之间用 flush 保证顺序：
+// 日志块落盘之后才写日志头，日志头（提交点）落盘之后才写回原位置，
+// 原位置落盘之后才清空日志头。清空日志头的 flush 推迟到下一次写日志块之前，
+// 否则旧日志头可能和新日志块一起落盘；清空丢失时重放也是幂等的
 static void commit(){
     if(log.lh.n > 0){
+        if(log.cleared){
+            log_barrier();
+            log.cleared = 0;
+        }
         write_log();     
+        log_barrier();
         write_head();    
+        log_barrier();
         install_trans(0);// recovering = 0
+        log_barrier();
         log.lh.n = 0;
         write_head();// clear the log
+        log.cleared = 1;
+        discard_freed();
+    }
+}
+
+// 记录事务中释放的块 b，相邻的块并入同一区间
+void log_free(uint b){
+  int i;
+
+  acquire(&log.lock);
+  if (log.outstanding < 1)
+    panic("log_free outside of trans");
+  for (i = 0; i < log.nfreed; i++) {
+    if (log.freed[i].start + log.freed[i].n == b) {
+      log.freed[i].n++;
+      break;
     }
+    if (log.freed[i].start == b + 1) {
+      log.freed[i].start = b;
+      log.freed[i].n++;
+      break;
+    }
+  }
+  if (i == log.nfreed) {
+    if (log.nfreed < NFREED) {
+      log.freed[i].start = b;
+      log.freed[i].n = 1;
+      log.nfreed++;
+    } else {
+      log.overflow = 1;
+    }
+  }
+  release(&log.lock);
+}
+
+// 块 b 被重新分配：从本批释放的区间中去掉它，否则提交后的 discard 会抹掉新内容。
+// 返回 b 是否可能在尚未提交的事务中被释放过（此时磁盘上它仍属于原来的文件）
+int log_reuse(uint b){
+  int i, r;
+  uint end;
+
+  acquire(&log.lock);
+  r = log.overflow;
+  for (i = 0; i < log.nfreed; i++) {
+    end = log.freed[i].start + log.freed[i].n;
+    if (b < log.freed[i].start || b >= end)
+      continue;
+    r = 1;
+    if (b == log.freed[i].start) {
+      log.freed[i].start++;
+      log.freed[i].n--;
+    } else {
+      log.freed[i].n = b - log.freed[i].start;
+      // 后半段放进新的一项；没有空位时少 discard 一些也无妨
+      if (b + 1 < end && log.nfreed < NFREED) {
+        log.freed[log.nfreed].start = b + 1;
+        log.freed[log.nfreed].n = end - b - 1;
+        log.nfreed++;
+      }
+    }
+    if (log.freed[i].n == 0)
+      log.freed[i] = log.freed[--log.nfreed];
+    break;
+  }
+  release(&log.lock);
+  return r;
 }
 
 // Add the block to the log.  Copy to log if necessary.
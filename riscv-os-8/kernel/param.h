@@ -5,13 +5,28 @@
 #define NCPU          1  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE_MAX 1024  // maximum number of cached i-nodes
+#define NDCACHE     256  // directory entry cache size
 #define NDEV         10  // maximum major device number
+#define VIRTIODEV     1  // device number of the virtio disk
+#define RAMDEV        2  // device number of the RAM disk (make RAMDISK=1)
+#ifdef RAMDISK_ROOT
+#define ROOTDEV  RAMDEV  // run the root file system from the RAM disk
+#else
 #define ROOTDEV       1  // device number of file system root disk
+#endif
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGBLOCKS    (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NFREED       32    // freed block ranges remembered per commit, for discard
+#define NBUF_MIN     (MAXOPBLOCKS*8)  // minimum size of disk block cache
+#define NBUF_MAX     4096  // maximum size of disk block cache
+#define BCACHE_SHARE 16    // block cache takes at most 1/BCACHE_SHARE of free memory
+#define RA_MIN        4    // initial read-ahead window in blocks
+#define RA_MAX       32    // maximum read-ahead window in blocks
+#define RSV_MIN       8    // initial block reservation window of a growing file
+#define RSV_MAX      64    // maximum block reservation window
+#define NRSV         16    // maximum number of block reservation windows
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define USERSTACK    1     // user stack pages
@@ -0,0 +1,102 @@
+#include "type.h"
+#include "riscv.h"
+#include "def.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "bdev.h"
+
+// 内存盘：直接在内核映像中嵌入的文件系统映像（make RAMDISK=1，由
+// ld -r -b binary fs.img 生成）上读写，没有设备延迟，用于单独测试
+// fs.c/log.c 的开销，或作为临时的高速文件系统
+
+#ifdef RAMDISK
+extern uchar _binary_fs_img_start[];
+extern uchar _binary_fs_img_end[];
+#endif
+
+static struct {
+  uchar *data;
+  uint nblocks;
+} rd;
+
+// 同步完成请求，提交返回时数据已经拷贝完毕
+static void ramdisk_submit(struct buf *b, int write)
+{
+  uchar *p;
+
+  if(b->blockno >= rd.nblocks)
+    panic("ramdisk: block out of range");
+  p = rd.data + (uint64)b->blockno * BSIZE;
+  if(write)
+    memmove(p, b->data, BSIZE);
+  else
+    memmove(b->data, p, BSIZE);
+
+  b->disk = 0;
+  if(b->async)
+    bdone(b);
+}
+
+static void ramdisk_wait(struct buf *b)
+{
+  if(b->disk)
+    panic("ramdisk_wait");
+}
+
+static int ramdisk_plug(void)
+{
+  return 0;
+}
+
+static void ramdisk_unplug(int q)
+{
+}
+
+static int ramdisk_flush(void)
+{
+  return 0;
+}
+
+// 丢弃的块直接清零，write zeroes 与 discard 相同
+static int ramdisk_discard(uint blockno, uint n)
+{
+  if(blockno + n > rd.nblocks)
+    return -1;
+  memset(rd.data + (uint64)blockno * BSIZE, 0, (uint64)n * BSIZE);
+  return 0;
+}
+
+static int ramdisk_write_zeroes(uint blockno, uint n)
+{
+  return ramdisk_discard(blockno, n);
+}
+
+static uint ramdisk_nblocks(void)
+{
+  return rd.nblocks;
+}
+
+static struct bdev_ops ramdisk_ops = {
+  .submit = ramdisk_submit,
+  .wait = ramdisk_wait,
+  .plug = ramdisk_plug,
+  .unplug = ramdisk_unplug,
+  .flush = ramdisk_flush,
+  .discard = ramdisk_discard,
+  .write_zeroes = ramdisk_write_zeroes,
+  .nblocks = ramdisk_nblocks,
+};
+
+// 有嵌入的映像时注册为 RAMDEV
+void ramdisk_init(void)
+{
+#ifdef RAMDISK
+  rd.data = _binary_fs_img_start;
+  rd.nblocks = (_binary_fs_img_end - _binary_fs_img_start) / BSIZE;
+  bdev_register(RAMDEV, "ramdisk", &ramdisk_ops);
+  printf("ramdisk: %d blocks\n", rd.nblocks);
+#endif
+}
@@ -15,6 +15,7 @@ read_mhartid()
 #define MSTATUS_MPP_M (3L << 11)
 #define MSTATUS_MPP_S (1L << 11)
 #define MSTATUS_MPP_U (0L << 11)
+#define MSTATUS_VS_INITIAL (1L << 9) // vector unit state: Initial (enabled)
 
 static inline uint64
 read_mstatus()
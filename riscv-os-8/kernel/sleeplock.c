@@ -12,6 +12,7 @@ void initsleeplock(struct sleeplock *lk, char *name)
 {
     initlock(&lk->lk, "sleeplock");// 初始化保护睡眠锁的自旋锁
     lk->locked = 0;
+    lk->sleeping = 0;
     lk->name = name;
     lk->pid = 0;
 }
@@ -24,7 +25,9 @@ void acquiresleep(struct sleeplock *lk)
     while(lk->locked) {
         if(myproc() == 0)
             panic("acquiresleep");
+        lk->sleeping++;
         sleep(lk, &lk->lk);// 睡眠等待锁释放
+        lk->sleeping--;
     }
 
     lk->locked = 1;// 获取锁成功
@@ -53,12 +56,30 @@ void releasesleep(struct sleeplock *lk)
     lk->locked = 0;// 释放锁
     lk->pid = 0;// 清除持有锁的进程ID
 
-    if(myproc() != 0)
+    if(myproc() != 0 && lk->sleeping)
         wakeup(lk);// 唤醒等待该锁的进程
 
     release(&lk->lk);// 释放保护睡眠锁的自旋锁
 }
 
+// 在中断上下文中释放睡眠锁（如异步 I/O 完成），不检查持有者
+void releasesleep_intr(struct sleeplock *lk)
+{
+    acquire(&lk->lk);
+
+    if(lk->locked == 0) {
+        panic("releasesleep_intr");
+    }
+
+    lk->locked = 0;
+    lk->pid = 0;
+    // 只有真的有进程在等这把锁时才唤醒，wakeup 要扫描整个进程表
+    if(lk->sleeping)
+        wakeup(lk);
+
+    release(&lk->lk);
+}
+
 // 检查当前进程是否持有睡眠锁
 int holdingsleep(struct sleeplock *lk)
 {
@@ -1,6 +1,7 @@
 struct sleeplock {
   uint locked;       // Is the lock held?
   struct spinlock lk; // spinlock protecting this sleep lock
+  int sleeping;       // 在 acquiresleep() 中睡眠等待的进程数
   
   // For debugging:
   char *name;        // Name of lock.
@@ -20,6 +20,7 @@ extern void iinit(void);
 extern void file_init(void);
 extern void fsinit(int);
 extern void fs_test(void);
+extern void disk_bench(void);
 extern void cow_kernel_test(void);
 extern int kthread_create(void (*start)(void), const char *name); // 声明创建线程函数
 void call_main(void);
@@ -83,6 +84,8 @@ void call_main(void) {
     virtio_disk_init();
     printf("Virtio disk initialized.\n");
 
+    ramdisk_init();
+
     binit();
     printf("Buffer cache initialized.\n");
 
@@ -92,10 +95,15 @@ void call_main(void) {
     file_init();
     printf("File table initialized.\n");
 
-    fsinit(1);
+    fsinit(ROOTDEV);
     printf("File system initialized.\n");
 
-    // fs_test();
+#ifdef FS_TEST
+    fs_test();
+#endif
+#ifdef DISK_BENCH
+    disk_bench();
+#endif
 
     // 创建第一个进程（其 context.ra 指向测试入口，不走用户态 sret）
     userinit();
@@ -106,6 +114,16 @@ void call_main(void) {
     initproc->state = SLEEPING; // 防止 initproc 运行
     release(&initproc->lock);
 
+    // 后台预清零线程，为 uvmalloc/vmfault/页表分配准备全 0 页
+    if(kthread_create(kzerod, "kzerod") < 0) {
+        panic("failed to create kzerod thread");
+    }
+
+    // 日志提交线程，把多个文件系统事务合并为一次提交
+    if(kthread_create(logd, "logd") < 0) {
+        panic("failed to create logd thread");
+    }
+
     if(kthread_create(cow_kernel_test, "cow_test") < 0) {
         panic("failed to create cow test thread");
     }
@@ -130,6 +148,11 @@ void start(void) {
     // 委托中断与异常给 S 模式
     intr_init_mmode();
 
+#ifdef __riscv_vector
+    // 打开向量单元，string.c 的 RVV 实现需要
+    write_mstatus(read_mstatus() | MSTATUS_VS_INITIAL);
+#endif
+
     // 禁用分页（清 satp），确保后续 S 模式自行加载页表
     write_satp(0);
 
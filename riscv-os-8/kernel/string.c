@@ -1,13 +1,91 @@
 #include "type.h"
+#include "riscv.h"
+#include "def.h"
+
+// 按字访问任意类型的内存，may_alias 避免与严格别名规则冲突
+typedef uint64 __attribute__((may_alias)) word;
+
+#define WSIZE sizeof(word)
+#define WMASK (WSIZE - 1)
+
+#ifdef __riscv_vector
+// RVV 版本：每次按 vsetvli 给出的长度处理一段，head/tail 由 vl 自然处理。
+// 陷阱入口和 swtch 都不保存向量寄存器，所以整个循环放在一个 asm 中并关中断，
+// vl 和 v8-v15 不会跨越中断或进程切换
+#define VCLOBBER "memory", "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15"
+
+static void
+vmemset(char *d, uchar c, uint n)
+{
+  uint64 vl, len = n;
+
+  if(n == 0)
+    return;
+  push_off();
+  asm volatile("1:\n\t"
+               "vsetvli %0, %2, e8, m8, ta, ma\n\t"
+               "vmv.v.x v8, %3\n\t"
+               "vse8.v v8, (%1)\n\t"
+               "add %1, %1, %0\n\t"
+               "sub %2, %2, %0\n\t"
+               "bnez %2, 1b"
+               : "=&r" (vl), "+r" (d), "+r" (len)
+               : "r" ((uint64)c)
+               : VCLOBBER);
+  pop_off();
+}
+
+static void
+vmemcpy(char *d, const char *s, uint n)
+{
+  uint64 vl, len = n;
+
+  if(n == 0)
+    return;
+  push_off();
+  asm volatile("1:\n\t"
+               "vsetvli %0, %3, e8, m8, ta, ma\n\t"
+               "vle8.v v8, (%2)\n\t"
+               "vse8.v v8, (%1)\n\t"
+               "add %1, %1, %0\n\t"
+               "add %2, %2, %0\n\t"
+               "sub %3, %3, %0\n\t"
+               "bnez %3, 1b"
+               : "=&r" (vl), "+r" (d), "+r" (s), "+r" (len)
+               :
+               : VCLOBBER);
+  pop_off();
+}
+#endif
 
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+
+#ifdef __riscv_vector
+  vmemset(cdst, c, n);
+#else
+  if(n >= 2*WSIZE){
+    uint64 w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+
+    // head: 对齐到 8 字节
+    while((uint64)cdst & WMASK){
+      *cdst++ = c;
+      n--;
+    }
+    word *wdst = (word *) cdst;
+    for(; n >= WSIZE; n -= WSIZE)
+      *wdst++ = w;
+    cdst = (char *) wdst;
   }
+  // tail
+  while(n-- > 0)
+    *cdst++ = c;
+#endif
   return dst;
 }
 
@@ -18,6 +96,21 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+
+  // 两者对齐方式相同时，先按 8 字节比较，遇到不同的字再逐字节定位
+  if(n >= 2*WSIZE && (((uint64)s1 ^ (uint64)s2) & WMASK) == 0){
+    while((uint64)s1 & WMASK){
+      if(*s1 != *s2)
+        return *s1 - *s2;
+      s1++, s2++, n--;
+    }
+    while(n >= WSIZE && *(const word *)s1 == *(const word *)s2){
+      s1 += WSIZE;
+      s2 += WSIZE;
+      n -= WSIZE;
+    }
+  }
+
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -38,18 +131,85 @@ memmove(void *dst, const void *src, uint n)
   
   s = src;
   d = dst;
+  // 源与目的相对对齐时才能按字拷贝
+  int aligned = n >= 2*WSIZE && (((uint64)s ^ (uint64)d) & WMASK) == 0;
+
   if(s < d && s + n > d){
     s += n;
     d += n;
+    if(aligned){
+      while((uint64)d & WMASK){
+        *--d = *--s;
+        n--;
+      }
+      for(; n >= WSIZE; n -= WSIZE){
+        d -= WSIZE;
+        s -= WSIZE;
+        *(word *)d = *(const word *)s;
+      }
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+#ifdef __riscv_vector
+    vmemcpy(d, s, n);
+#else
+    if(aligned){
+      while((uint64)d & WMASK){
+        *d++ = *s++;
+        n--;
+      }
+      for(; n >= WSIZE; n -= WSIZE){
+        *(word *)d = *(const word *)s;
+        d += WSIZE;
+        s += WSIZE;
+      }
+    }
     while(n-- > 0)
       *d++ = *s++;
+#endif
+  }
 
   return dst;
 }
 
+// 整页清零，dst 必须按页对齐
+void
+zero_page(void *dst)
+{
+#ifdef __riscv_vector
+  vmemset(dst, 0, PGSIZE);
+#else
+  word *d = (word *) dst;
+  word *e = d + PGSIZE / WSIZE;
+
+  for(; d < e; d += 8){
+    d[0] = 0; d[1] = 0; d[2] = 0; d[3] = 0;
+    d[4] = 0; d[5] = 0; d[6] = 0; d[7] = 0;
+  }
+#endif
+}
+
+// 整页拷贝，dst 与 src 必须按页对齐且不重叠
+void
+copy_page(void *dst, const void *src)
+{
+#ifdef __riscv_vector
+  vmemcpy(dst, src, PGSIZE);
+#else
+  word *d = (word *) dst;
+  const word *s = (const word *) src;
+  word *e = d + PGSIZE / WSIZE;
+
+  for(; d < e; d += 8, s += 8){
+    uint64 a0 = s[0], a1 = s[1], a2 = s[2], a3 = s[3];
+    uint64 a4 = s[4], a5 = s[5], a6 = s[6], a7 = s[7];
+    d[0] = a0; d[1] = a1; d[2] = a2; d[3] = a3;
+    d[4] = a4; d[5] = a5; d[6] = a6; d[7] = a7;
+  }
+#endif
+}
+
 // memcpy exists to placate GCC.  Use memmove.
 void*
 memcpy(void *dst, const void *src, uint n)
@@ -77,6 +77,7 @@ extern uint64 sys_exit(void);
 extern uint64 sys_wait(void);
 extern uint64 sys_getpid(void);
 extern uint64 sys_kill(void);
+extern uint64 sys_sync(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -84,6 +85,7 @@ static uint64 (*syscalls[])(void) = {
 [SYS_wait]    sys_wait,
 [SYS_getpid]  sys_getpid,
 [SYS_kill]    sys_kill,
+[SYS_sync]    sys_sync,
 };
 
 void syscall(void)
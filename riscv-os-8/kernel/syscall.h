@@ -2,4 +2,5 @@
 #define SYS_exit 2
 #define SYS_wait 3
 #define SYS_getpid 4
-#define SYS_kill 5
\ No newline at end of file
+#define SYS_kill 5
+#define SYS_sync 6
\ No newline at end of file
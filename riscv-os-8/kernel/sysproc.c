@@ -39,3 +39,9 @@ uint64 sys_kill(void)
   return kkill(pid);
 }
 
+// 等待此前结束的文件系统操作都已提交到磁盘
+uint64 sys_sync(void)
+{
+  log_sync();
+  return 0;
+}
@@ -6,7 +6,9 @@
 #define VIRTIO_MMIO_DEVICE_ID		0x008 // device type; 1 is net, 2 is disk
 #define VIRTIO_MMIO_VENDOR_ID		0x00c // 0x554d4551
 #define VIRTIO_MMIO_DEVICE_FEATURES	0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL	0x014 // selects which 32 feature bits DEVICE_FEATURES shows
 #define VIRTIO_MMIO_DRIVER_FEATURES	0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL	0x024
 #define VIRTIO_MMIO_QUEUE_SEL		0x030 // select queue, write-only
 #define VIRTIO_MMIO_QUEUE_NUM_MAX	0x034 // max size of current queue, read-only
 #define VIRTIO_MMIO_QUEUE_NUM		0x038 // size of current queue, write-only
@@ -29,15 +31,43 @@
 #define VIRTIO_CONFIG_S_FEATURES_OK	8
 
 // Virtio block device feature flags
+#define VIRTIO_BLK_F_SEG_MAX         2	//Maximum number of segments in a request is in seg_max
 #define VIRTIO_BLK_F_RO              5	//Disk is read-only
 #define VIRTIO_BLK_F_SCSI            7	//Supports scsi command passthru
+#define VIRTIO_BLK_F_FLUSH           9	//Cache flush command support
 #define VIRTIO_BLK_F_CONFIG_WCE     11	//Writeback mode available in config
 #define VIRTIO_BLK_F_MQ             12	//support more than one vq
+#define VIRTIO_BLK_F_DISCARD        13	//Device can support discard command
+#define VIRTIO_BLK_F_WRITE_ZEROES   14	//Device can support write zeroes command
 #define VIRTIO_F_ANY_LAYOUT         27
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
+#define VIRTIO_F_VERSION_1          32
+#define VIRTIO_F_RING_PACKED        34
 
-#define NUM 8
+#define NUM 32 // 队列大小
+#define MAXSEG 16 // 一个请求最多合并的数据块数
+
+// 等待请求完成的方式，见 virtio_disk_wait()
+#define VDISK_DEFAULT 0 // 单个请求用：按驱动的默认方式
+#define VDISK_INTR   1 // 睡眠等待中断
+#define VDISK_POLL   2 // 轮询已用环，最多 POLL_SPIN 后睡眠
+#define VDISK_HYBRID 3 // 先在自适应的时间窗口内轮询，超时再睡眠
+// 驱动的默认方式，编译时可用 -DVDISK_POLLMODE=VDISK_HYBRID 等改变
+#ifndef VDISK_POLLMODE
+#define VDISK_POLLMODE VDISK_INTR
+#endif
+#define POLL_MAX  1000 // 混合模式最长轮询时间（time 计数，qemu 上约 100us）
+#define POLL_SPIN 100000 // 轮询模式最长轮询时间（qemu 上约 10ms），设备太慢时改为睡眠
+
+// 设备配置空间（virtio-mmio 从 0x100 开始）
+#define VIRTIO_MMIO_CONFIG 0x100
+#define VIRTIO_BLK_CFG_CAPACITY 0 // uint64 capacity in 512-byte sectors
+#define VIRTIO_BLK_CFG_SEG_MAX 12 // uint32 seg_max
+#define VIRTIO_BLK_CFG_WRITEBACK 32 // uint8 writeback (VIRTIO_BLK_F_CONFIG_WCE): 1 写回，0 直写
+#define VIRTIO_BLK_CFG_NUM_QUEUES 34 // uint16 num_queues (VIRTIO_BLK_F_MQ)
+#define VIRTIO_BLK_CFG_MAX_DISCARD 36 // uint32 max_discard_sectors (VIRTIO_BLK_F_DISCARD)
+#define VIRTIO_BLK_CFG_MAX_WRITE_ZEROES 48 // uint32 max_write_zeroes_sectors (VIRTIO_BLK_F_WRITE_ZEROES)
 
 struct virtq_desc {
     uint64 addr;   // Address (guest-physical)
@@ -48,13 +78,14 @@ struct virtq_desc {
 
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // buffer contains a table of descriptors
 
 // (otherwise read-only).
 struct virtq_avail{
     uint16 flags;//标志位，未使用，置0
     uint16 idx;//驱动程序放入可用描述符的索引
     uint16 ring[NUM];//实际大小为队列大小
-    uint16 unused;//未使用，置0
+    uint16 used_event;//EVENT_IDX：已用环索引到达该值时设备才发中断
 };
 
 struct virtq_used_elem {
@@ -66,13 +97,54 @@ struct virtq_used {
     uint16 flags;//标志位，未使用，置0
     uint16 idx;//设备放入已用描述符的索引
     struct virtq_used_elem ring[NUM];//实际大小为队列大小
+    uint16 avail_event;//EVENT_IDX：可用环索引越过该值时驱动才需要通知设备
 };
 
+#define VRING_USED_F_NO_NOTIFY 1 // device doesn't need a kick (without EVENT_IDX)
+
+// EVENT_IDX：索引从 old 前进到 new_idx 时，是否越过了对方要求的 event
+static inline int vring_need_event(uint16 event, uint16 new_idx, uint16 old)
+{
+    return (uint16)(new_idx - event - 1) < (uint16)(new_idx - old);
+}
+
+// 紧凑环（VIRTIO_F_RING_PACKED）：描述符、可用和已用信息都在同一个环中
+struct pvirtq_desc {
+    uint64 addr;   // Buffer address
+    uint32 len;    // Buffer length
+    uint16 id;     // Buffer ID
+    uint16 flags;  // VRING_DESC_F_* 以及下面的 AVAIL/USED 位
+};
+
+#define VRING_PACKED_DESC_F_AVAIL (1 << 7)
+#define VRING_PACKED_DESC_F_USED  (1 << 15)
+
+// 事件抑制结构，驱动和设备各一个
+struct pvirtq_event {
+    uint16 off_wrap; // 位 0-14 环内位置，位 15 回绕计数
+    uint16 flags;    // VRING_PACKED_EVENT_FLAG_*
+};
+
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0 // 每次都通知
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1 // 不要通知
+#define VRING_PACKED_EVENT_FLAG_DESC    2 // 到达 off_wrap 时通知（需要 EVENT_IDX）
+#define VRING_PACKED_EVENT_F_WRAP_CTR  15
+
 #define VIRTIO_BLK_T_IN		0	//读操作
 #define VIRTIO_BLK_T_OUT	1	//写操作
+#define VIRTIO_BLK_T_FLUSH	4	//写缓存落盘
+#define VIRTIO_BLK_T_DISCARD	11	//丢弃扇区
+#define VIRTIO_BLK_T_WRITE_ZEROES	13	//扇区写为全 0
 
 struct virtio_blk_req {
     uint32 type;      // VIRTIO_BLK_T_IN or VIRTIO_BLK_T_OUT
     uint32 reserved;  // 保留字段，置0
     uint64 sector;    // 扇区号
-};
\ No newline at end of file
+};
+
+// discard / write zeroes 请求的数据段，描述一段扇区
+struct virtio_blk_range {
+    uint64 sector;       // 起始扇区
+    uint32 num_sectors;  // 扇区数
+    uint32 flags;        // 位 0：write zeroes 时允许设备 unmap
+};
@@ -8,34 +8,190 @@
 #include "fs.h"
 #include "buf.h"
 #include "virtio.h"
+#include "bdev.h"
+#include "iosched.h"
 
 #define R(r) ((volatile uint32*)(VIRTIO0 + r))
 
-static struct disk{
-    // virtio 描述符、可用环和已用环
+// 一个虚拟队列。每个 hart 使用自己的队列，各自加锁，互不干扰
+struct virtq{
+    // 分离环：virtio 描述符、可用环和已用环
     struct virtq_desc* desc;
     // 可用环和已用环指针
     struct virtq_avail* avail;
     // 已用环指针
     struct virtq_used* used;
-    char free[NUM];// 描述符是否空闲的标志数组
+    char free[NUM];// 描述符是否空闲的标志数组，用于检查重复释放
+    uint16 fstack[NUM];// 空闲描述符栈
+    int nfree;// 栈中空闲描述符数
     uint16 used_idx;// 已用环的索引
+
+    // 紧凑环：描述符环和两个事件抑制结构放在同一页
+    struct pvirtq_desc *pdesc;
+    struct pvirtq_event *pdriver;// 驱动写，控制设备何时发中断
+    struct pvirtq_event *pdevice;// 设备写，控制驱动何时通知
+    uint16 next_avail;// 下一个可用的环位置
+    uint16 last_used;// 下一个要检查的已用位置
+    char avail_wrap;// 驱动的回绕计数
+    char used_wrap;// 期望的设备回绕计数
+    int pfree;// 环中空闲的位置数
+    uint16 nslot[NUM];// 每个缓冲区 ID 占用的环位置数
     struct {
-        struct buf *b;
+        struct buf *b;// 请求的第一个缓冲块，其余的用 qnext 串起来
         char status;
+        int *cmd;// 不带缓冲块的命令请求：完成时把设备状态写到这里
+        uint64 stime;// 提交时间，用于统计完成延迟
     } info[NUM];// 每个描述符对应的缓冲区和状态
 
     struct virtio_blk_req ops[NUM];// 当前请求结构体
-    struct spinlock vdisk_lock;// 保护磁盘结构体的自旋锁
+    struct virtio_blk_range range[NUM];// discard / write zeroes 请求的扇区范围
+    // 间接描述符表，每个请求头描述符一张：请求头 + MAXSEG 个数据块 + 状态
+    union {
+        struct virtq_desc split[NUM][MAXSEG + 2];
+        struct pvirtq_desc packed[NUM][MAXSEG + 2];
+    } indirect;
+    uint64 lat;// 请求完成延迟的滑动平均（time 计数）
+    int plugged;// 大于 0 时新请求只排队不提交，以便合并相邻块
+    struct ioq ioq;// 等待下发的请求，由 I/O 调度器排序与合并
+    int id;// 队列号，通知设备时写入 QUEUE_NOTIFY
+    struct spinlock lock;// 保护本队列的自旋锁
+};
+
+static struct disk{
+    struct virtq vq[NCPU];
+    int nvq;// 实际使用的队列数
+    int packed;// 使用紧凑环（VIRTIO_F_RING_PACKED）
+    int use_indirect;// 设备支持 VIRTIO_RING_F_INDIRECT_DESC
+    int maxseg;// 一个请求最多的数据块数
+    int event_idx;// 设备支持 VIRTIO_RING_F_EVENT_IDX
+    int pollmode;// 默认等待方式 VDISK_*
+    int flush;// 设备有写缓存，需要 VIRTIO_BLK_T_FLUSH 才能落盘
+    int discard;// 设备支持 VIRTIO_BLK_F_DISCARD
+    int write_zeroes;// 设备支持 VIRTIO_BLK_F_WRITE_ZEROES
+    uint32 max_discard;// 一个 discard 请求最多的扇区数
+    uint32 max_write_zeroes;// 一个 write zeroes 请求最多的扇区数
 } disk;
 
+// 请求中的一段连续内存，对应一个描述符
+struct vseg {
+  uint64 addr;
+  uint32 len;
+  int write;// 设备写入（读请求的数据和状态字节）
+};
+
+// 当前 hart 使用的队列
+static struct virtq *myvq(void)
+{
+  struct virtq *vq;
+
+  push_off();
+  vq = &disk.vq[cpuid() % disk.nvq];
+  pop_off();
+  return vq;
+}
+
+// 初始化队列 q
+static void virtq_init(struct virtq *vq, int q)
+{
+  initlock(&vq->lock, "virtio_disk");
+  vq->id = q;
+  ioq_init(&vq->ioq, "virtio", IOSCHED_DEFAULT);
+
+  // initialize queue q.
+  *R(VIRTIO_MMIO_QUEUE_SEL) = q;
+
+  // ensure queue is not in use.
+  if(*R(VIRTIO_MMIO_QUEUE_READY))
+    panic("virtio disk should not be ready");
+
+  // check maximum queue size.
+  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max == 0)
+    panic("virtio disk has no queue");
+  if(max < NUM)
+    panic("virtio disk max queue too short");
+
+  // set queue size.
+  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+
+  if(disk.packed){
+    // 一页放下整个紧凑环（NUM*16 字节）和两个事件结构
+    char *pg = alloc_zeroed();
+    if(pg == 0)
+      panic("virtio disk kalloc");
+    vq->pdesc = (struct pvirtq_desc *)pg;
+    vq->pdriver = (struct pvirtq_event *)(pg + NUM * sizeof(struct pvirtq_desc));
+    vq->pdevice = vq->pdriver + 1;
+    vq->avail_wrap = 1;
+    vq->used_wrap = 1;
+    vq->pfree = NUM;
+    vq->pdriver->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+
+    *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)vq->pdesc;
+    *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)vq->pdesc >> 32;
+    *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)vq->pdriver;
+    *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)vq->pdriver >> 32;
+    *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)vq->pdevice;
+    *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)vq->pdevice >> 32;
+  } else {
+    // allocate and zero queue memory.
+    vq->desc = alloc();
+    vq->avail = alloc();
+    vq->used = alloc();
+    if(!vq->desc || !vq->avail || !vq->used)
+      panic("virtio disk kalloc");
+    memset(vq->desc, 0, PGSIZE);
+    memset(vq->avail, 0, PGSIZE);
+    memset(vq->used, 0, PGSIZE);
+
+    // write physical addresses.
+    *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)vq->desc;
+    *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)vq->desc >> 32;
+    *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)vq->avail;
+    *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)vq->avail >> 32;
+    *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)vq->used;
+    *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)vq->used >> 32;
+  }
+
+  // queue is ready.
+  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // all NUM descriptors start out unused.
+  for(int i = 0; i < NUM; i++){
+    vq->free[i] = 1;
+    vq->fstack[i] = NUM - 1 - i;
+  }
+  vq->nfree = NUM;
+}
+
+// 设备给出的单个 discard/write zeroes 请求的扇区数上限，按块对齐；0 视为不限
+static uint32 range_max(uint32 max)
+{
+  max -= max % (BSIZE / 512);
+  return max ? max : 0xffffffff - 0xffffffff % (BSIZE / 512);
+}
+
+static int virtio_disk_flush(void);
+static int virtio_disk_discard(uint, uint);
+static int virtio_disk_write_zeroes(uint, uint);
+static uint virtio_disk_nblocks(void);
+
+static struct bdev_ops virtio_disk_ops = {
+  .submit = virtio_disk_submit,
+  .wait = virtio_disk_wait,
+  .plug = virtio_disk_plug,
+  .unplug = virtio_disk_unplug,
+  .flush = virtio_disk_flush,
+  .discard = virtio_disk_discard,
+  .write_zeroes = virtio_disk_write_zeroes,
+  .nblocks = virtio_disk_nblocks,
+};
+
 // 初始化 virtio 磁盘设备
 void virtio_disk_init(void)
 {
     uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
-
   printf("Magic value read: 0x%x\n", *R(VIRTIO_MMIO_MAGIC_VALUE));
   printf("Version read: 0x%x\n", *R(VIRTIO_MMIO_VERSION));
   printf("Device ID read: 0x%x\n", *R(VIRTIO_MMIO_DEVICE_ID));
@@ -60,15 +216,31 @@ void virtio_disk_init(void)
   *R(VIRTIO_MMIO_STATUS) = status;
 
   // negotiate features
+  *R(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 0;
   uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
+  *R(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 1;
+  uint64 hi = *R(VIRTIO_MMIO_DEVICE_FEATURES);
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
-  features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+  // 高 32 位只接受紧凑环，紧凑环要求 VERSION_1
+  features |= hi << 32;
+  features &= ((1UL << 32) - 1) | (1UL << VIRTIO_F_VERSION_1) | (1UL << VIRTIO_F_RING_PACKED);
+#ifdef VIRTIO_FORCE_SPLIT
+  features &= ~(1UL << VIRTIO_F_RING_PACKED);
+#endif
+  if(!(features & (1UL << VIRTIO_F_RING_PACKED)))
+    features &= (1UL << 32) - 1;
+  *R(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 0;
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  *R(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 1;
+  *R(VIRTIO_MMIO_DRIVER_FEATURES) = features >> 32;
+  disk.packed = (features >> VIRTIO_F_RING_PACKED) & 1;
+  disk.event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
+  disk.use_indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  disk.flush = (features >> VIRTIO_BLK_F_FLUSH) & 1;
+  disk.discard = (features >> VIRTIO_BLK_F_DISCARD) & 1;
+  disk.write_zeroes = (features >> VIRTIO_BLK_F_WRITE_ZEROES) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -79,232 +251,619 @@ void virtio_disk_init(void)
   if(!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic("virtio disk FEATURES_OK unset");
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-
-  // ensure queue 0 is not in use.
-  if(*R(VIRTIO_MMIO_QUEUE_READY))
-    panic("virtio disk should not be ready");
-
-  // check maximum queue size.
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-
-  // allocate and zero queue memory.
-  disk.desc = alloc();
-  disk.avail = alloc();
-  disk.used = alloc();
-  if(!disk.desc || !disk.avail || !disk.used)
-    panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
-
-  // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-
-  // write physical addresses.
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
-
-  // queue is ready.
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+  // 每个 hart 一个队列，但不超过设备提供的队列数
+  disk.nvq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ)){
+    uint16 nq = *(volatile uint16 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_NUM_QUEUES);
+    disk.nvq = nq < NCPU ? nq : NCPU;
+    if(disk.nvq < 1)
+      disk.nvq = 1;
+  }
+  for(int q = 0; q < disk.nvq; q++)
+    virtq_init(&disk.vq[q], q);
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  // 间接描述符下一个请求只占一个描述符；否则整条链都在描述符表中，
+  // 合并的块数受队列大小限制
+  if(disk.use_indirect)
+    disk.maxseg = MAXSEG;
+  else
+    disk.maxseg = NUM / 4;
+  if(features & (1 << VIRTIO_BLK_F_SEG_MAX)){
+    uint32 seg_max = *R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_SEG_MAX);
+    if(seg_max > 0 && seg_max < disk.maxseg)
+      disk.maxseg = seg_max;
+  }
+  // 能 flush 时打开设备的写回缓存，日志用 flush 作为写屏障；
+  // 不能 flush 时设备只能按直写处理
+  if(features & (1 << VIRTIO_BLK_F_CONFIG_WCE))
+    *(volatile uchar *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_WRITEBACK) = disk.flush;
+  if(disk.discard)
+    disk.max_discard = range_max(*R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_MAX_DISCARD));
+  if(disk.write_zeroes)
+    disk.max_write_zeroes = range_max(*R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_MAX_WRITE_ZEROES));
+  printf("virtio disk: %s ring, %d queues, indirect %d, event_idx %d, max %d blocks per request\n",
+         disk.packed ? "packed" : "split", disk.nvq, disk.use_indirect, disk.event_idx, disk.maxseg);
+  printf("virtio disk: write cache %d, discard %d, write zeroes %d\n", disk.flush, disk.discard, disk.write_zeroes);
+  virtio_disk_pollmode(VDISK_POLLMODE);
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
   *R(VIRTIO_MMIO_STATUS) = status;
-}
 
-// 分配一个空闲的描述符，返回其索引，失败返回 -1
-static int alloc_desc(void)
-{
-    for(int i = 0; i < NUM; i++){
-        if(disk.free[i]){
-            disk.free[i] = 0;
-            return i;
-        }
-    }
-    return -1;
+  bdev_register(VIRTIODEV, "virtio", &virtio_disk_ops);
 }
 
-// 释放描述符
-static void free_desc(int i)
+// 释放描述符，压回空闲栈
+static void free_desc(struct virtq *vq, int i)
 {
     if(i >= NUM) panic("free_desc index out of range");
-    if(disk.free[i]) panic("free_desc freeing free descriptor");
-    disk.desc[i].addr = 0;
-    disk.desc[i].len = 0;
-    disk.desc[i].flags = 0;
-    disk.desc[i].next = 0;
-    disk.free[i] = 1;
-    wakeup(&disk.free[0]);
+    if(vq->free[i]) panic("free_desc freeing free descriptor");
+    if(!disk.packed){
+        vq->desc[i].addr = 0;
+        vq->desc[i].len = 0;
+        vq->desc[i].flags = 0;
+        vq->desc[i].next = 0;
+    }
+    vq->free[i] = 1;
+    vq->fstack[vq->nfree++] = i;
 }
 
 // 释放描述符链
-static void free_chain(int i)
+// 没有进程在等描述符：拿不到描述符的请求留在软件队列里，
+// 由 virtio_disk_reap() 在释放之后直接提交，不需要唤醒任何进程
+static void free_chain(struct virtq *vq, int i)
 {
     while(1){
-        if(disk.desc[i].flags & VRING_DESC_F_NEXT){
-            int next = disk.desc[i].next;
-            free_desc(i);
+        if(vq->desc[i].flags & VRING_DESC_F_NEXT){
+            int next = vq->desc[i].next;
+            free_desc(vq, i);
             i = next;
         } else {
-            free_desc(i);
+            free_desc(vq, i);
             break;
         }
     }
 }
 
-// 分配三个描述符，返回0表示成功，-1表示失败
-static int alloc3_desc(int *idx)
+// 一次分配 n 个描述符，空闲数不够时什么也不做并返回-1
+// 紧凑环中环位置另外计数，这里只分配缓冲区 ID
+static int alloc_descs(struct virtq *vq, int n, int *idx)
 {
-    // printf("alloc3_desc: trying to allocate 3 descriptors\n");
-    for(int i = 0; i < 3; i++){
-        int d = alloc_desc();
-        if(d < 0){
-            for(int j = 0; j < i; j++)
-                free_desc(idx[j]);
-            return -1;
-        }
-        idx[i] = d;
+    if(vq->nfree < n)
+        return -1;
+    for(int i = 0; i < n; i++){
+        idx[i] = vq->fstack[--vq->nfree];
+        vq->free[idx[i]] = 0;
     }
     return 0;
 }
 
-// 读写磁盘块
-void virtio_disk_rw(struct buf *b, int write)
-{ 
-  // printf("virtio_disk_rw: b=%x write=%d\n", b, write);
-  uint64 sector = b->blockno * (BSIZE / 512);
+// 填写缓冲区 id 的请求头，返回其地址
+static struct virtio_blk_req *setup_req(struct virtq *vq, int id, uint32 type, uint64 sector)
+{
+  struct virtio_blk_req *buf0 = &vq->ops[id];
+
+  buf0->type = type;
+  buf0->reserved = 0;
+  buf0->sector = sector;
+  vq->info[id].status = 0xff; // device writes 0 on success
+  return buf0;
+}
 
-  acquire(&disk.vdisk_lock);
+// 读写请求的各段：请求头、以 b 开头用 qnext 串起的 nseg 个连续块、状态字节
+static void buf_segs(struct virtq *vq, struct buf *b, int nseg, int id, struct vseg *s)
+{
+  struct virtio_blk_req *buf0;
+  int i;
+
+  buf0 = setup_req(vq, id, b->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, b->blockno * (BSIZE / 512));
+  s[0] = (struct vseg){ (uint64)buf0, sizeof(struct virtio_blk_req), 0 };
+  for(i = 1; i <= nseg; i++, b = b->qnext)
+    s[i] = (struct vseg){ (uint64)b->data, BSIZE, !b->write };
+  s[nseg+1] = (struct vseg){ (uint64)&vq->info[id].status, 1, 1 };
+}
 
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      // printf("Allocated descriptors %d, %d, %d\n", idx[0], idx[1], idx[2]);
-      break;
+// 分离环：把 n 段组成的请求放入可用环，调用者需持有 vq->lock。
+// idx 是已分配的描述符（间接模式下只有 idx[0]）
+static void split_setup(struct virtq *vq, struct vseg *s, int n, int *idx)
+{
+  int head = idx[0];
+  struct virtq_desc *d;
+  int i;
+
+  // format the descriptors.
+  // qemu's virtio-blk.c reads them.
+
+  // 间接模式下在请求自己的描述符表中构造链，next 是表内下标
+  if(disk.use_indirect){
+    d = vq->indirect.split[head];
+    for(i = 0; i < n; i++)
+      idx[i] = i;
+  } else {
+    d = vq->desc;
+  }
+
+  for(i = 0; i < n; i++){
+    d[idx[i]].addr = s[i].addr;
+    d[idx[i]].len = s[i].len;
+    d[idx[i]].flags = s[i].write ? VRING_DESC_F_WRITE : 0;
+    d[idx[i]].next = 0;
+    if(i < n - 1){
+      d[idx[i]].flags |= VRING_DESC_F_NEXT;
+      d[idx[i]].next = idx[i+1];
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
-  // qemu's virtio-blk.c reads them.
+  if(disk.use_indirect){
+    vq->desc[head].addr = (uint64) d;
+    vq->desc[head].len = n * sizeof(struct virtq_desc);
+    vq->desc[head].flags = VRING_DESC_F_INDIRECT;
+    vq->desc[head].next = 0;
+  }
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  // tell the device the first index in our chain of descriptors.
+  vq->avail->ring[vq->avail->idx % NUM] = head;
 
-  // printf("virtio_disk_rw: sector=%d write=%d\n", sector, write);
+  __sync_synchronize();
 
-  if(write)
-    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
-  else
-    buf0->type = VIRTIO_BLK_T_IN; // read the disk
-  buf0->reserved = 0;
-  buf0->sector = sector;
+  // tell the device another avail ring entry is available.
+  vq->avail->idx += 1; // not % NUM ...
+}
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+// 紧凑环：在 next_avail 处写一个描述符并前进，回绕时翻转 avail_wrap。
+// 返回带 AVAIL/USED 位的 flags；链的第一个描述符（head）先不写 flags，
+// 由调用者在整条链写好之后再写，设备看到它才会读整条链
+static uint16 packed_put(struct virtq *vq, uint64 addr, uint32 len, int id, uint16 flags, int head)
+{
+  struct pvirtq_desc *d = &vq->pdesc[vq->next_avail];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
+  d->addr = addr;
+  d->len = len;
+  d->id = id;
+  if(vq->avail_wrap)
+    flags |= VRING_PACKED_DESC_F_AVAIL;
   else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+    flags |= VRING_PACKED_DESC_F_USED;
+  if(++vq->next_avail == NUM){
+    vq->next_avail = 0;
+    vq->avail_wrap ^= 1;
+  }
+  if(!head)
+    d->flags = flags;
+  return flags;
+}
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+// 紧凑环：把 n 段组成的缓冲区 id 的请求放入环中，
+// 调用者需持有 vq->lock 并已预留 nslot 个环位置
+static void packed_setup(struct virtq *vq, struct vseg *s, int n, int id)
+{
+  struct pvirtq_desc *hd = &vq->pdesc[vq->next_avail];
+  uint16 first = 0, f;
+  int i;
+
+  if(disk.use_indirect){
+    // 紧凑环的间接表是顺序排列的描述符，不用 NEXT
+    struct pvirtq_desc *t = vq->indirect.packed[id];
+    for(i = 0; i < n; i++)
+      t[i] = (struct pvirtq_desc){ s[i].addr, s[i].len, id, s[i].write ? VRING_DESC_F_WRITE : 0 };
+    first = packed_put(vq, (uint64)t, n * sizeof(struct pvirtq_desc), id, VRING_DESC_F_INDIRECT, 1);
+    vq->nslot[id] = 1;
+  } else {
+    for(i = 0; i < n; i++){
+      f = s[i].write ? VRING_DESC_F_WRITE : 0;
+      if(i < n - 1)
+        f |= VRING_DESC_F_NEXT;
+      f = packed_put(vq, s[i].addr, s[i].len, id, f, i == 0);
+      if(i == 0)
+        first = f;
+    }
+    vq->nslot[id] = n;
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  __sync_synchronize();
+  hd->flags = first;
+}
 
-  // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+// 紧凑环：位置从 old 前进到 new 之后是否需要通知设备
+static int packed_need_kick(struct virtq *vq, uint16 old, uint16 new)
+{
+  uint16 off_wrap = vq->pdevice->off_wrap;
+  uint16 flags = vq->pdevice->flags;
+  uint16 event;
+
+  if(flags != VRING_PACKED_EVENT_FLAG_DESC)
+    return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+  event = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+  if((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != vq->avail_wrap)
+    event -= NUM;
+  return vring_need_event(event, new, old);
+}
 
-  // printf("virtio_disk_rw: avail->idx=%d\n", disk.avail->idx);
+// 放入了 added 个环位置（分离环可用环原来的索引为 old）之后按需通知设备
+// 设备正在处理可用环时不需要再通知它：EVENT_IDX 下只有越过设备给出的
+// avail_event 才通知，否则看 NO_NOTIFY 标志。省下的是每次写寄存器引起的 MMIO 退出
+static void virtq_kick(struct virtq *vq, uint16 old, int added)
+{
+  if(added == 0)
+    return;
 
   __sync_synchronize();
+  if(disk.packed){
+    if(!packed_need_kick(vq, vq->next_avail - added, vq->next_avail))
+      return;
+  } else if(disk.event_idx){
+    if(!vring_need_event(vq->used->avail_event, vq->avail->idx, old))
+      return;
+  } else if(vq->used->flags & VRING_USED_F_NO_NOTIFY){
+    return;
+  }
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = vq->id; // value is queue number
+}
 
-  // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+// 把请求队列中的请求尽可能多地放入虚拟队列，调用者需持有 vq->lock。
+// 下发顺序和相邻块的合并由 I/O 调度器决定
+static void virtio_disk_start(struct virtq *vq)
+{
+  int idx[MAXSEG + 2];
+  struct vseg s[MAXSEG + 2];
+  int added = 0;
+  struct buf *b;
+  int nseg, nslot;
+  uint16 old = disk.packed ? 0 : vq->avail->idx;
+
+  while(!vq->plugged && (b = ioq_peek(&vq->ioq, disk.maxseg, &nseg)) != 0){
+    nslot = disk.use_indirect ? 1 : nseg + 2;
+    if(disk.packed){
+      if(vq->pfree < nslot || alloc_descs(vq, 1, idx) < 0)
+        break;
+      vq->pfree -= nslot;
+    } else if(alloc_descs(vq, nslot, idx) < 0){
+      break;
+    }
 
-  __sync_synchronize();
+    ioq_take(&vq->ioq);
+
+    // record struct buf for virtio_disk_intr().
+    vq->info[idx[0]].b = b;
+    vq->info[idx[0]].cmd = 0;
+    vq->info[idx[0]].stime = read_time();
+    buf_segs(vq, b, nseg, idx[0], s);
+    if(disk.packed)
+      packed_setup(vq, s, nseg + 2, idx[0]);
+    else
+      split_setup(vq, s, nseg + 2, idx);
+    added += nslot;
+  }
+
+  virtq_kick(vq, old, added);
+}
+
+// 开始批量提交：在 virtio_disk_unplug() 之前本 hart 队列中的新请求只排队，
+// 以便相邻块合并。两者之间不能睡眠；返回的队列号交给 virtio_disk_unplug()
+int virtio_disk_plug(void)
+{
+  struct virtq *vq = myvq();
+
+  acquire(&vq->lock);
+  vq->plugged++;
+  release(&vq->lock);
+  return vq->id;
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+void virtio_disk_unplug(int q)
+{
+  struct virtq *vq = &disk.vq[q];
+
+  acquire(&vq->lock);
+  if(vq->plugged <= 0)
+    panic("virtio_disk_unplug");
+  if(--vq->plugged == 0)
+    virtio_disk_start(vq);
+  release(&vq->lock);
+}
+
+// 异步提交读写请求，不等待完成；描述符不够时请求在队列中排队
+// 调用者需持有 b 的睡眠锁，并在之后调用 virtio_disk_wait(b)
+void virtio_disk_submit(struct buf *b, int write)
+{
+  struct virtq *vq = myvq();
+
+  acquire(&vq->lock);
+
+  b->disk = 1;
+  b->write = write;
+  b->qid = vq->id;
+  ioq_add(&vq->ioq, b);
+
+  virtio_disk_start(vq);
+
+  release(&vq->lock);
+}
+
+static void virtio_disk_reap(struct virtq *vq);
+
+// 设置默认的等待方式 VDISK_INTR/POLL/HYBRID，单个请求可以用 b->poll 覆盖
+void virtio_disk_pollmode(int mode)
+{
+  if(mode != VDISK_INTR && mode != VDISK_POLL && mode != VDISK_HYBRID)
+    panic("virtio_disk_pollmode");
+  __atomic_store_n(&disk.pollmode, mode, __ATOMIC_RELAXED);
+}
+
+// 等待 b 上已提交的请求完成
+// 轮询时由等待者自己回收已用环，省去中断和调度的往返；混合模式只轮询
+// 约两倍平均延迟的时间（不超过 POLL_MAX），轮询模式最多 POLL_SPIN，超时再睡眠等中断。
+// 两次回收之间放开队列锁，中断和其他 CPU 不会被慢设备卡住。
+// 没有进程上下文时（启动阶段）不能睡眠，只能一直轮询
+void virtio_disk_wait(struct buf *b)
+{
+  struct virtq *vq = &disk.vq[b->qid];
+  int mode;
+  uint64 deadline;
+
+  acquire(&vq->lock);
+
+  mode = b->poll != VDISK_DEFAULT ? b->poll : disk.pollmode;
+  if(myproc() == 0)
+    mode = VDISK_POLL;
+
+  if(mode != VDISK_INTR){
+    if(mode == VDISK_HYBRID)
+      deadline = read_time() + (vq->lat * 2 < POLL_MAX ? vq->lat * 2 : POLL_MAX);
+    else
+      deadline = read_time() + POLL_SPIN;
+    while(b->disk == 1){
+      if(myproc() != 0 && read_time() > deadline)
+        break;
+      virtio_disk_reap(vq);
+      if(b->disk != 1)
+        break;
+      release(&vq->lock);
+      acquire(&vq->lock);
+    }
+  }
 
   // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    if(myproc() != 0) {
-        // 正常模式：有进程上下文，可以睡眠等待中断唤醒
-        sleep(b, &disk.vdisk_lock);
-    } else {
-        // 启动模式：没有进程上下文，必须使用忙等待（轮询）
-        // 必须释放锁，以便中断处理程序(virtio_disk_intr)能获取锁并更新 b->disk
-        release(&disk.vdisk_lock);
-        
-        // 开启中断，让 PLIC 能接收磁盘中断
-        // 注意：在 S 模式下，sstatus.SIE 位控制中断
-        intr_on(); 
-        
-        // 等待一小会儿（或者什么都不做，纯轮询）
-        // 这里其实是在等待 virtio_disk_intr 被触发
-        // 当中断发生时，CPU 跳转到 trap -> kernelvec -> devintr -> virtio_disk_intr
-        // virtio_disk_intr 会修改 b->disk = 0
-        
-        // 重新获取锁以检查 b->disk
-        intr_off(); // 关中断以保证原子性（视你的自旋锁实现而定，通常 acquire 会关中断）
-        acquire(&disk.vdisk_lock);
+  while(b->disk == 1){
+    b->sleeping = 1;
+    sleep(b, &vq->lock);
+  }
+  b->sleeping = 0;
+
+  release(&vq->lock);
+}
+
+// 提交一个不带缓冲块的命令请求（flush、discard、write zeroes）并等待完成，
+// 返回设备状态。nsect 为 0 时请求没有扇区范围段（flush）。
+// 命令不经过 I/O 调度器：暂停本队列的下发，回收已用环直到空出足够的描述符，
+// 放入请求后恢复下发
+static int virtio_disk_cmd(uint32 type, uint64 sector, uint32 nsect)
+{
+  struct virtq *vq = myvq();
+  struct vseg s[3];
+  int idx[MAXSEG + 2];
+  int n = nsect ? 3 : 2;
+  int nslot = disk.use_indirect ? 1 : n;
+  int id, status = -1;
+  uint16 old;
+
+  acquire(&vq->lock);
+  vq->plugged++;
+  while(disk.packed ? (vq->pfree < nslot || vq->nfree < 1) : vq->nfree < nslot){
+    virtio_disk_reap(vq);
+    // 同 virtio_disk_wait()，两次回收之间放开队列锁
+    release(&vq->lock);
+    acquire(&vq->lock);
+  }
+  if(disk.packed){
+    vq->pfree -= nslot;
+    alloc_descs(vq, 1, idx);
+  } else {
+    alloc_descs(vq, nslot, idx);
+  }
+  id = idx[0];
+  old = disk.packed ? 0 : vq->avail->idx;
+
+  vq->info[id].b = 0;
+  vq->info[id].cmd = &status;
+  vq->info[id].stime = read_time();
+  vq->range[id] = (struct virtio_blk_range){ sector, nsect, 0 };
+  s[0] = (struct vseg){ (uint64)setup_req(vq, id, type, 0), sizeof(struct virtio_blk_req), 0 };
+  s[1] = (struct vseg){ (uint64)&vq->range[id], sizeof(struct virtio_blk_range), 0 };
+  s[n-1] = (struct vseg){ (uint64)&vq->info[id].status, 1, 1 };
+  if(disk.packed)
+    packed_setup(vq, s, n, id);
+  else
+    split_setup(vq, s, n, idx);
+  virtq_kick(vq, old, nslot);
+
+  if(--vq->plugged == 0)
+    virtio_disk_start(vq);
+
+  // 没有进程上下文时轮询
+  while(status < 0){
+    if(myproc() == 0)
+      virtio_disk_reap(vq);
+    else
+      sleep(&status, &vq->lock);
+  }
+  release(&vq->lock);
+  return status;
+}
+
+// 把设备写缓存中已完成的写请求落盘。只有写请求完成之后才能保证被这次
+// flush 覆盖，调用者要先等它们完成。设备没有写缓存时写请求完成即已落盘
+static int virtio_disk_flush(void)
+{
+  if(!disk.flush)
+    return 0;
+  return virtio_disk_cmd(VIRTIO_BLK_T_FLUSH, 0, 0) == 0 ? 0 : -1;
+}
+
+// 把 [blockno, blockno+n) 按每个请求最多 max 个扇区拆分成命令请求
+static int virtio_disk_range(uint32 type, uint blockno, uint n, uint32 max)
+{
+  uint64 sector = (uint64)blockno * (BSIZE / 512);
+  uint64 left = (uint64)n * (BSIZE / 512);
+  uint32 k;
+
+  while(left > 0){
+    k = left < max ? left : max;
+    if(virtio_disk_cmd(type, sector, k) != 0)
+      return -1;
+    sector += k;
+    left -= k;
+  }
+  return 0;
+}
+
+// 通知设备这些块不再使用，设备可以回收其后端存储
+static int virtio_disk_discard(uint blockno, uint n)
+{
+  if(!disk.discard)
+    return -1;
+  return virtio_disk_range(VIRTIO_BLK_T_DISCARD, blockno, n, disk.max_discard);
+}
+
+// 由设备把这些块写为全 0，不传输数据
+static int virtio_disk_write_zeroes(uint blockno, uint n)
+{
+  if(!disk.write_zeroes)
+    return -1;
+  return virtio_disk_range(VIRTIO_BLK_T_WRITE_ZEROES, blockno, n, disk.max_write_zeroes);
+}
+
+// 配置空间 capacity 以 512 字节扇区为单位
+static uint virtio_disk_nblocks(void)
+{
+  uint64 lo = *R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_CAPACITY);
+  uint64 hi = *R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4);
+
+  return ((hi << 32) | lo) / (BSIZE / 512);
+}
+
+// 读写磁盘块（同步）
+void virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(b, write);
+  virtio_disk_wait(b);
+}
+
+// 完成缓冲区 id 对应的请求
+static void complete(struct virtq *vq, int id)
+{
+  if(vq->info[id].cmd){
+    // 命令请求的失败由发起者处理，也不计入读写延迟
+    *vq->info[id].cmd = (uchar)vq->info[id].status;
+    wakeup(vq->info[id].cmd);
+    vq->info[id].cmd = 0;
+    return;
+  }
+  if(vq->info[id].status != 0){
+    panic("virtio disk intr status");
+  }
+  // 滑动平均 lat = 7/8 lat + 1/8 本次延迟，决定混合轮询的窗口
+  uint64 t = read_time() - vq->info[id].stime;
+  vq->lat = vq->lat - (vq->lat >> 3) + (t >> 3);
+  struct buf *b = vq->info[id].b, *next;
+  vq->info[id].b = 0;
+  for(; b; b = next){
+    next = b->qnext;
+    b->qnext = 0;
+    b->disk = 0;
+    // 异步块交给 bdone()；同步块的等待者轮询时没有睡眠，不必唤醒
+    if(b->async)
+      bdone(b);
+    else if(b->sleeping)
+      wakeup(b);
+  }
+}
+
+static void split_reap(struct virtq *vq)
+{
+  for(;;){
+    while(vq->used_idx != vq->used->idx){
+      __sync_synchronize();
+      int id = vq->used->ring[vq->used_idx % NUM].id;
+      complete(vq, id);
+      free_chain(vq, id);
+      vq->used_idx += 1;
     }
+
+    if(!disk.event_idx)
+      break;
+    // 下一次完成时再发中断；在此之前完成的请求会被设备合并到同一次中断。
+    // 写 used_event 之后再检查一次，防止错过写入之前刚完成的请求
+    vq->avail->used_event = vq->used_idx;
+    __sync_synchronize();
+    if(vq->used_idx == vq->used->idx)
+      break;
   }
+}
 
-  // printf("virtio_disk_rw: woke up b=%x\n", b);
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// 紧凑环中 last_used 处的描述符是否已被设备用完
+static int packed_used(struct virtq *vq)
+{
+  uint16 flags = vq->pdesc[vq->last_used].flags;
+  int avail = (flags & VRING_PACKED_DESC_F_AVAIL) != 0;
+  int used = (flags & VRING_PACKED_DESC_F_USED) != 0;
 
-  // printf("virtio_disk_rw: completed\n");
+  return avail == used && used == vq->used_wrap;
+}
+
+static void packed_reap(struct virtq *vq)
+{
+  for(;;){
+    while(packed_used(vq)){
+      __sync_synchronize();
+      int id = vq->pdesc[vq->last_used].id;
+      complete(vq, id);
+      // 设备为整条链只写一个已用描述符，跳过这条链占用的其余位置
+      vq->last_used += vq->nslot[id];
+      if(vq->last_used >= NUM){
+        vq->last_used -= NUM;
+        vq->used_wrap ^= 1;
+      }
+      vq->pfree += vq->nslot[id];
+      free_desc(vq, id);
+    }
 
-  release(&disk.vdisk_lock);
+    if(!disk.event_idx)
+      break;
+    // 与分离环相同：下一次完成时再发中断，写完再检查一次
+    vq->pdriver->off_wrap = vq->last_used | (vq->used_wrap << VRING_PACKED_EVENT_F_WRAP_CTR);
+    vq->pdriver->flags = VRING_PACKED_EVENT_FLAG_DESC;
+    __sync_synchronize();
+    if(!packed_used(vq))
+      break;
+  }
+}
+
+// 回收已用环中所有完成的请求并提交排队的请求，调用者需持有 vq->lock。
+// 中断处理程序和轮询的等待者都通过它完成请求
+static void virtio_disk_reap(struct virtq *vq)
+{
+  if(disk.packed)
+    packed_reap(vq);
+  else
+    split_reap(vq);
+
+  // 有描述符被释放，继续提交排队的请求
+  virtio_disk_start(vq);
 }
 
 // virtio 磁盘中断处理程序
+// virtio-mmio 设备只有一条中断线，无法把各队列的完成中断分别送到
+// 对应的 hart，所以这里依次检查所有队列，每个队列只持有自己的锁
 void virtio_disk_intr(void)
 {
-  acquire(&disk.vdisk_lock);
-
   *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   __sync_synchronize();
 
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-    if(disk.info[id].status != 0){
-      panic("virtio disk intr status");
-    }
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;
-    wakeup(b);
-    disk.used_idx += 1;
+  for(int q = 0; q < disk.nvq; q++){
+    acquire(&disk.vq[q].lock);
+    virtio_disk_reap(&disk.vq[q]);
+    release(&disk.vq[q].lock);
   }
-
-  release(&disk.vdisk_lock);
 }
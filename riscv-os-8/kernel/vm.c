@@ -15,11 +15,10 @@ extern char trampoline[];//trampoline.S
 //创建一个新的页表
 pagetable_t create_pagetable(){
     pagetable_t pagetable;
-    pagetable = (pagetable_t)alloc();
+    pagetable = (pagetable_t)alloc_zeroed();
     if(pagetable == 0){
         return 0;//分配失败
     }
-    memset(pagetable, 0, PGSIZE);
     return pagetable;
 }
 
@@ -37,10 +36,9 @@ pte_t *walk_create(pagetable_t pagetable, uint64 va){
         }
         else{
             //not exist, create a new page table
-            if((pagetable = (pde_t*)alloc()) == 0){
+            if((pagetable = (pde_t*)alloc_zeroed()) == 0){
                 return 0;//Out of memory
             }
-            memset(pagetable, 0, PGSIZE);//try to alloc a new page
             *pte = PA2PTE(pagetable) | PTE_V;
         }
     }
@@ -131,7 +129,6 @@ void kvmmake(pagetable_t kpgtbl, uint64 va, uint64 pa,uint64 sz, int perm){
 
 pagetable_t map_region(){
     pagetable_t kpgtbl = create_pagetable();
-    memset(kpgtbl, 0, PGSIZE);
 
 
     // --- 调试代码 START ---
@@ -184,9 +181,8 @@ pte_t *walk(pagetable_t pagetable, uint64 va, int kalloc)
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!kalloc || (pagetable = (pde_t*)alloc()) == 0)
+      if(!kalloc || (pagetable = (pde_t*)alloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
@@ -252,12 +248,11 @@ uint64 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = alloc();
+    mem = alloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -343,11 +338,17 @@ int cow_alloc(pagetable_t pagetable, uint64 va){
   pa = PTE2PA(*pte);
   flags = PTE_FLAGS(*pte);
 
+  // 其他共享者都已释放该页（例如子进程已退出），直接恢复写权限，无需复制
+  if(kref_get((void *)pa) == 1){
+    *pte = PA2PTE(pa) | ((flags | PTE_W) & ~PTE_COW);
+    return 0;
+  }
+
   // 分配新内存
   if((mem = alloc()) == 0)
     return -1;
 
-  memmove(mem, (char *)pa, PGSIZE);
+  copy_page(mem, (char *)pa);
 
   // 修改页表项：指向新物理页，设置可写 (PTE_W)，清除 COW 标志
   flags = (flags | PTE_W) & (~PTE_COW);
@@ -445,10 +446,9 @@ uint64 vmfault(pagetable_t pagetable, uint64 va, int read)
   if(ismapped(pagetable, va)) {
     return 0;
   }
-  mem = (uint64) alloc();
+  mem = (uint64) alloc_zeroed();
   if(mem == 0)
     return 0;
-  memset((void *) mem, 0, PGSIZE);
   if (mappages(p->pagetable, va, PGSIZE, mem, PTE_W|PTE_U|PTE_R) != 0) {
     kfree((void *)mem);
     return 0;
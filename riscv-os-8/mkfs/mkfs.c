@@ -40,6 +40,8 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+uint emap(struct dinode *din, uint fbn);
+void wdir(uint inum, struct dirent *de, int n);
 void die(const char *);
 
 // convert to riscv byte order
@@ -68,11 +70,10 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
+  int i, cc, fd, nde;
+  uint rootino, inum;
+  static struct dirent de[NINODES];
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
@@ -84,6 +85,7 @@ main(int argc, char *argv[])
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert(sizeof(struct extent_block) == BSIZE);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
@@ -117,15 +119,12 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  // 根目录的目录项先收集起来，最后一次写入（项多时用索引格式）
+  de[0].inum = xshort(rootino);
+  strcpy(de[0].name, ".");
+  de[1].inum = xshort(rootino);
+  strcpy(de[1].name, "..");
+  nde = 2;
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -151,10 +150,10 @@ main(int argc, char *argv[])
     
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    assert(nde < NINODES);
+    de[nde].inum = xshort(inum);
+    strncpy(de[nde].name, shortname, DIRSIZ);
+    nde++;
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -162,12 +161,7 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  wdir(rootino, de, nde);
 
   balloc(freeblock);
 
@@ -251,6 +245,81 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// 在 n 项的区间数组末尾追加逻辑块 fbn，与最后一个区间连续时延长它。
+// 项数组满时返回 -1
+int
+eappend(struct extent *e, int n, int max, uint fbn, uint pblk)
+{
+  if(n > 0 && xint(e[n-1].pblk) + xint(e[n-1].len) == pblk){
+    e[n-1].len = xint(xint(e[n-1].len) + 1);
+    return n;
+  }
+  if(n == max)
+    return -1;
+  e[n].lblk = xint(fbn);
+  e[n].pblk = xint(pblk);
+  e[n].len = xint(1);
+  return n + 1;
+}
+
+// 返回逻辑块 fbn 的物理块号，fbn 是下一个要追加的块时分配它。
+// mkfs 放入的文件基本是连续的，这里只用到深度 0 和 1 的区间树
+uint
+emap(struct dinode *din, uint fbn)
+{
+  struct extent_block eb;
+  struct extent *last;
+  uint leaf;
+  int n, depth = xshort(din->ext_depth);
+
+  n = xshort(din->ext_n);
+  if(depth == 0){
+    if(n > 0){
+      last = &din->ext[n-1];
+      if(fbn < xint(last->lblk) + xint(last->len))
+        return xint(last->pblk) + fbn - xint(last->lblk);
+    }
+    n = eappend(din->ext, n, NEXTENT, fbn, freeblock);
+    if(n > 0){
+      din->ext_n = xshort(n);
+      return freeblock++;
+    }
+    // 根满了，把它的项搬到一个叶子中
+    bzero(&eb, sizeof(eb));
+    eb.n = din->ext_n;
+    eb.depth = xshort(0);
+    memmove(eb.e, din->ext, sizeof(din->ext));
+    leaf = freeblock++;
+    wsect(leaf, &eb);
+    bzero(din->ext, sizeof(din->ext));
+    din->ext[0].pblk = xint(leaf);
+    din->ext_n = xshort(1);
+    din->ext_depth = xshort(1);
+    return emap(din, fbn);
+  }
+
+  assert(depth == 1);
+  leaf = xint(din->ext[n-1].pblk);
+  rsect(leaf, &eb);
+  last = &eb.e[xshort(eb.n)-1];
+  if(fbn < xint(last->lblk) + xint(last->len))
+    return xint(last->pblk) + fbn - xint(last->lblk);
+  n = eappend(eb.e, xshort(eb.n), EXT_PER_BLOCK, fbn, freeblock);
+  if(n < 0){
+    // 叶子满了，在根中加一个新叶子
+    assert(xshort(din->ext_n) < NEXTENT);
+    bzero(&eb, sizeof(eb));
+    leaf = freeblock++;
+    n = eappend(eb.e, 0, EXT_PER_BLOCK, fbn, freeblock);
+    din->ext[xshort(din->ext_n)].lblk = xint(fbn);
+    din->ext[xshort(din->ext_n)].pblk = xint(leaf);
+    din->ext_n = xshort(xshort(din->ext_n) + 1);
+  }
+  eb.n = xshort(n);
+  wsect(leaf, &eb);
+  return freeblock++;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -258,7 +327,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -267,22 +335,7 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = emap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -295,6 +348,64 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+int
+dehashcmp(const void *a, const void *b)
+{
+  uint x = dirhash(((struct dirent*)a)->name);
+  uint y = dirhash(((struct dirent*)b)->name);
+
+  return x < y ? -1 : x > y;
+}
+
+// 写入目录 inum 的 n 个目录项，前两项是 "." 和 ".."。
+// 一块装不满时是目录项数组，否则按 hash 排序装满各个叶子，在第 0 块建索引
+void
+wdir(uint inum, struct dirent *de, int n)
+{
+  struct dx_entry dx[DX_MAX];
+  struct dinode din;
+  uint off;
+  int i, cnt, nleaf;
+
+  if(n < DPB){
+    iappend(inum, de, n * sizeof(*de));
+    // fix size of root inode dir
+    rinode(inum, &din);
+    off = xint(din.size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(inum, &din);
+    return;
+  }
+
+  qsort(de + DX_FIRST, n - DX_FIRST, sizeof(*de), dehashcmp);
+  nleaf = (n - DX_FIRST + DPB - 1) / DPB;
+  assert(nleaf <= DX_MAX);
+  bzero(dx, sizeof(dx));
+  for(i = 0; i < nleaf; i++){
+    dx[i].block = xint(i + 1);
+    if(i > 0){
+      // hash 相同的名字必须在同一个叶子中
+      assert(dirhash(de[DX_FIRST + i*DPB].name) != dirhash(de[DX_FIRST + i*DPB - 1].name));
+      dx[i].hash = xint(dirhash(de[DX_FIRST + i*DPB].name));
+    }
+  }
+  dx[0].count = xshort(nleaf);
+
+  iappend(inum, de, DX_FIRST * sizeof(*de));
+  iappend(inum, dx, sizeof(dx));
+  for(i = 0; i < nleaf; i++){
+    cnt = min(n - DX_FIRST - i*DPB, DPB);
+    iappend(inum, de + DX_FIRST + i*DPB, cnt * sizeof(*de));
+    if(cnt < DPB)
+      iappend(inum, zeroes, (DPB - cnt) * sizeof(*de));
+  }
+
+  rinode(inum, &din);
+  din.flags = I_DXDIR;
+  winode(inum, &din);
+}
+
 void
 die(const char *s)
 {